@@ -8,6 +8,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <X11/Xlib.h>
@@ -18,27 +20,52 @@
 #include "ipc.h"
 #include "utils.h"
 
+struct command {
+    const char* name;
+    enum IPCCommand cmd;
+    bool config;
+    int argc;
+    void (*handler)(long *, bool, int, char **);
+};
+
+/* An encoded command, ready to be sent by either transport */
+struct request {
+    const struct command *cmd;
+    long data[IPC_RECORD_LEN];
+    const char *payload; /* string argument, if the command takes one */
+};
+
 static void fn_hex(long *, bool, int, char **);
 static void fn_int(long *, bool, int, char **);
 static void fn_bool(long *, bool, int, char **);
-static void fn_font(long *, bool, int, char **);
 static void fn_str(long *, bool, int, char **);
 static void fn_int_str(long *, bool, int, char **);
 static void usage(FILE *);
 static void fn_mask(long *, bool, int, char **);
+static void fn_query(long *, bool, int, char **);
+static void fn_drag(long *, bool, int, char **);
+static void fn_stats(long *, bool, int, char **);
+static void fn_config(long *, bool, int, char **);
+static void fn_place(long *, bool, int, char **);
 static void version(void);
+static const struct command *find_command(const char *, int);
+static void encode_command(const struct command *, int, char **, struct request *);
+static void x_set_font(const char *);
+static void x_name_desktop(int, const char *);
+static int x_send(int, struct request *);
+static int ipc_connect(void);
+static int ipc_write(int, const void *, size_t);
+static int ipc_read(int, void *, size_t);
+static int ipc_send(int, int, struct request *);
+static int send_requests(int, struct request *);
+static char *next_arg(char **);
+static int send_batch(int, char **);
+static int read_batch(FILE *);
+static int subscribe(int, char **);
 
 static Display* display = NULL;
 static Window root = 0;
 
-struct command {
-    const char* name;
-    enum IPCCommand cmd;
-    bool config;
-    int argc;
-    void (*handler)(long *, bool, int, char **);
-};
-
 static const struct command command_table[] = {
     { "window_move",            IPCWindowMoveRelative,      false, 2, fn_int     },
     { "window_move_absolute",   IPCWindowMoveAbsolute,      false, 2, fn_int     },
@@ -73,11 +100,12 @@ static const struct command command_table[] = {
     { "top_gap",                IPCTopGap,                  true,  1, fn_int     },
     { "edge_gap",               IPCEdgeGap,                 false, 4, fn_int     },
     { "save_monitor",           IPCSaveMonitor,             false, 2, fn_int     },
-    { "smart_place",            IPCSmartPlace,              true,  1, fn_bool    },
+    { "smart_place",            IPCSmartPlace,              true,  1, fn_place   },
     { "draw_text",              IPCDrawText,                true,  1, fn_bool    },
     { "edge_lock",              IPCEdgeLock,                true,  1, fn_bool    },
-    { "set_font",               IPCSetFont,                 false, 1, fn_font    },
+    { "set_font",               IPCSetFont,                 false, 1, NULL       },
     { "json_status",            IPCJSONStatus,              true,  1, fn_bool    },
+    { "shm_status",             IPCShmStatus,               true,  1, fn_bool    },
     { "manage",                 IPCManage,                  true,  1, fn_str     },
     { "unmanage",               IPCUnmanage,                true,  1, fn_str     },
     { "decorate_new",           IPCDecorate,                true,  1, fn_bool    },
@@ -86,7 +114,17 @@ static const struct command command_table[] = {
     { "resize_mask",            IPCResizeMask,              true,  1, fn_mask    },
     { "pointer_interval",       IPCPointerInterval,         true,  1, fn_int     },
     { "focus_follows_pointer",  IPCFocusFollowsPointer,     true,  1, fn_bool    },
+    { "focus_delay",            IPCFocusDelay,              true,  1, fn_int     },
     { "warp_pointer",           IPCWarpPointer,             true,  1, fn_bool    },
+    { "title_pixmap",           IPCTitlePixmap,             true,  1, fn_bool    },
+    { "query",                  IPCQuery,                   false, 1, fn_query   },
+    { "drag_mode",              IPCDragMode,                true,  1, fn_drag    },
+    { "reparent",               IPCReparent,                true,  1, fn_bool    },
+    { "workspace_count",        IPCWorkspaceCount,          true,  1, fn_int     },
+    { "trace",                  IPCTrace,                   false, 0, NULL       },
+    { "stats",                  IPCStats,                   false, 0, NULL       },
+    { "stats",                  IPCStats,                   false, 1, fn_stats   },
+    { "config",                 IPCConfigTransaction,       false, 1, fn_config  },
 };
 
 static void
@@ -122,56 +160,14 @@ fn_str(long *data, bool b, int i, char **argv)
     else if (strcmp(argv[i-1], "Utility") == 0) data[i+b] = Utility;
 }
 
-/* This function works by setting a new atom globally on the root
- * window called BERRY_FONT_PROPERTY which tells berry what font
- * to use for window decoration.
- * We set the font here in the client and then send a message to
- * berry, notifying the main program to read this value
- */
-static void
-fn_font(long *data, bool b, int i, char** argv)
-{
-    UNUSED(b);
-    UNUSED(i);
-    UNUSED(data);
-    char** font_list;
-    XTextProperty font_prop;
-
-    font_list = malloc(sizeof(char*));
-    font_list[0] = argv[0];
-    Xutf8TextListToTextProperty(display, font_list, 1,
-                                XUTF8StringStyle, &font_prop);
-    XSetTextProperty(display, root, &font_prop, XInternAtom(display, BERRY_FONT_PROPERTY, False));
-    XFree(font_prop.value);
-    free(font_list);
-}
-
-/*
- * This function sets the _NET_DESKTOP_NAMES property
- * by assocating the first argument, an integer,
- * and the following string to the _NET_DESKTOP_NAMES property
+/* The workspace index goes in the message, the name is sent as the
+ * request payload or written by x_name_desktop.
  */
 static void
 fn_int_str(long *data, bool b, int i, char **argv)
 {
-    UNUSED(b);
-    UNUSED(data);
-    UNUSED(i);
-    char *name;
-    char **list;
-    int idx, len;
-    XTextProperty text_prop;
-
-    name = argv[1];
-    idx = atoi(argv[0]);
-    XGetTextProperty(display, root, &text_prop, XInternAtom(display, "_NET_DESKTOP_NAMES", False));
-    Xutf8TextPropertyToTextList(display, &text_prop, &list, &len);
-    list[idx] = name;
-    Xutf8TextListToTextProperty(display, list, WORKSPACE_NUMBER, XUTF8StringStyle, &text_prop);
-    XSetTextProperty(display, root, &text_prop, XInternAtom(display, "_NET_DESKTOP_NAMES", False));
-
-    XFree(text_prop.value);
-    free(list);
+    if (i == 1)
+        data[i+b] = atoi(argv[0]);
 }
 
 static void
@@ -199,11 +195,65 @@ fn_mask(long *data, bool b, int i, char **argv)
     }
 }
 
+static void
+fn_query(long *data, bool b, int i, char **argv)
+{
+    static const char *kinds[IPCQueryLast] = {
+        [IPCQueryWindows]    = "windows",
+        [IPCQueryWorkspaces] = "workspaces",
+        [IPCQueryMonitors]   = "monitors",
+        [IPCQueryFocused]    = "focused",
+    };
+
+    data[i+b] = -1;
+    for (int k = 0; k < IPCQueryLast; k++)
+        if (strcmp(argv[i-1], kinds[k]) == 0)
+            data[i+b] = k;
+}
+
+static void
+fn_stats(long *data, bool b, int i, char **argv)
+{
+    data[i+b] = strcmp(argv[i-1], "reset") == 0 ? 1 : -1;
+}
+
+static void
+fn_config(long *data, bool b, int i, char **argv)
+{
+    if (strcmp(argv[i-1], "begin") == 0) data[i+b] = 1;
+    else if (strcmp(argv[i-1], "commit") == 0) data[i+b] = 0;
+    else data[i+b] = -1;
+}
+
+static void
+fn_drag(long *data, bool b, int i, char **argv)
+{
+    if (strcmp(argv[i-1], "interval") == 0) data[i+b] = DragInterval;
+    else if (strcmp(argv[i-1], "adaptive") == 0) data[i+b] = DragAdaptive;
+    else if (strcmp(argv[i-1], "outline") == 0) data[i+b] = DragOutline;
+    else data[i+b] = -1;
+}
+
+static void
+fn_place(long *data, bool b, int i, char **argv)
+{
+    if (strcmp(argv[i-1], "false") == 0) data[i+b] = PlaceCenter;
+    else if (strcmp(argv[i-1], "true") == 0) data[i+b] = PlaceGrid;
+    else if (strcmp(argv[i-1], "grid") == 0) data[i+b] = PlaceGrid;
+    else if (strcmp(argv[i-1], "first") == 0) data[i+b] = PlaceFirst;
+    else if (strcmp(argv[i-1], "best") == 0) data[i+b] = PlaceBest;
+    else if (strcmp(argv[i-1], "overlap") == 0) data[i+b] = PlaceOverlap;
+    else data[i+b] = -1;
+}
+
 static void
 usage(FILE *out)
 {
     int rc = out == stderr ? EXIT_FAILURE : EXIT_SUCCESS;
-    fputs("Usage: berryc [-h|-v] <command> [args...]\n", out);
+    fputs("Usage: berryc [-h|-v] <command> [args...]\n"
+          "       berryc batch <\"command [args...]\">...\n"
+          "       berryc subscribe [focus|ws|map|unmap|geometry|title]...\n"
+          "       berryc -\n", out);
     exit(rc);
 }
 
@@ -214,24 +264,41 @@ version(void)
     exit(EXIT_SUCCESS);
 }
 
-static void
-send_command(const struct command *c, int argc, char **argv)
+/* Look up the given command, reporting an error if it does not exist
+ * or is given the wrong number of arguments. A command may be listed
+ * once for each number of arguments it takes.
+ */
+static const struct command *
+find_command(const char *name, int argc)
 {
-    XEvent ev;
-    UNUSED(argc);
+    const struct command *found = NULL;
 
-    display = XOpenDisplay(NULL);
+    for (int i = 0; i < (int)(sizeof command_table / sizeof command_table[0]); i++) {
+        if (strcmp(name, command_table[i].name) == 0) {
+            if (command_table[i].argc == argc)
+                return &command_table[i];
+            found = &command_table[i];
+        }
+    }
 
-    if (!display)
-        return;
+    if (found != NULL) {
+        printf("Wrong number of arguments\n");
+        printf("%d expected for command %s\n", found->argc, found->name);
+        return NULL;
+    }
 
-    root = DefaultRootWindow(display);
+    fprintf(stderr, "Command not found %s, exiting\n", name);
+    return NULL;
+}
 
-    memset(&ev, 0, sizeof ev);
-    ev.xclient.type = ClientMessage;
-    ev.xclient.window = root;
-    ev.xclient.message_type = XInternAtom(display, BERRY_CLIENT_EVENT, False);
-    ev.xclient.format = 32;
+/* Fill in the IPC_RECORD_LEN longs and string argument describing the
+ * given command.
+ */
+static void
+encode_command(const struct command *c, int argc, char **argv, struct request *req)
+{
+    memset(req, 0, sizeof *req);
+    req->cmd = c;
 
     /* We use the following protocol:
      * If the given command is related to berry's config then assign it a value of
@@ -240,32 +307,443 @@ send_command(const struct command *c, int argc, char **argv)
      * Otherwise, set the IPC command at d[0] and assign arguments from 1 upwards.
      */
     if (c->config) {
-        ev.xclient.data.l[0] = IPCConfig;
-        ev.xclient.data.l[1] = c->cmd;
+        req->data[0] = IPCConfig;
+        req->data[1] = c->cmd;
     } else {
-        ev.xclient.data.l[0] = c->cmd;
+        req->data[0] = c->cmd;
+    }
+
+    if (c->cmd == IPCSetFont)
+        req->payload = argv[0];
+    else if (c->cmd == IPCNameDesktop)
+        req->payload = argv[1];
+
+    for (int i = 1; i <= argc && c->handler != NULL; i++) {
+        (c->handler)(req->data, c->config, i, argv);
+    }
+}
+
+/* Without the socket the font travels through BERRY_FONT_PROPERTY on the
+ * root window, the set_font message then tells berry to read it.
+ */
+static void
+x_set_font(const char *name)
+{
+    char *font_list[1];
+    XTextProperty font_prop;
+
+    font_list[0] = (char *)name;
+    Xutf8TextListToTextProperty(display, font_list, 1,
+                                XUTF8StringStyle, &font_prop);
+    XSetTextProperty(display, root, &font_prop, XInternAtom(display, BERRY_FONT_PROPERTY, False));
+    XFree(font_prop.value);
+}
+
+/*
+ * This function sets the _NET_DESKTOP_NAMES property
+ * by assocating the given index with the given name
+ */
+static void
+x_name_desktop(int idx, const char *name)
+{
+    char **list = NULL, **copy;
+    int len = 0, count;
+    XTextProperty text_prop;
+    Atom names = XInternAtom(display, "_NET_DESKTOP_NAMES", False);
+
+    /* berry keeps one name per workspace, however many there are */
+    if (idx < 0 || !XGetTextProperty(display, root, &text_prop, names))
+        return;
+    Xutf8TextPropertyToTextList(display, &text_prop, &list, &len);
+    XFree(text_prop.value);
+    if (list == NULL || idx >= len) {
+        if (list)
+            XFreeStringList(list);
+        return;
     }
 
-    if (strcmp(c->name, "name_desktop") == 0) {
-        fn_int_str(ev.xclient.data.l, false, 2, argv);
-        XSync(display, false);
+    count = len;
+    copy = calloc(count, sizeof(char *));
+    if (copy == NULL) {
+        XFreeStringList(list);
         return;
     }
+    for (int i = 0; i < count; i++)
+        copy[i] = list[i];
+    copy[idx] = (char *)name;
+
+    Xutf8TextListToTextProperty(display, copy, count, XUTF8StringStyle, &text_prop);
+    XSetTextProperty(display, root, &text_prop, names);
+
+    XFree(text_prop.value);
+    free(copy);
+    XFreeStringList(list);
+}
+
+/* Send requests as X client messages, used when berry's control socket
+ * is not available. A single request goes in one ClientMessage, more are
+ * appended to BERRY_CLIENT_BATCH on the root window and a single
+ * ClientMessage tells berry to apply them in order.
+ */
+static int
+x_send(int n, struct request *reqs)
+{
+    XEvent ev;
+    long *records;
+    int count, rc;
+    Atom batch;
+
+    display = XOpenDisplay(NULL);
+    if (!display)
+        return EXIT_FAILURE;
+    root = DefaultRootWindow(display);
+
+    records = calloc(n > 0 ? n : 1, IPC_RECORD_LEN * sizeof(long));
+    if (records == NULL) {
+        XCloseDisplay(display);
+        return EXIT_FAILURE;
+    }
 
-    for (int i = 1; i <= argc; i++) {
-        (c->handler)(ev.xclient.data.l, c->config, i, argv);
+    count = 0;
+    rc = EXIT_SUCCESS;
+    for (int i = 0; i < n; i++) {
+        if (reqs[i].cmd->cmd == IPCQuery || reqs[i].cmd->cmd == IPCTrace ||
+                (reqs[i].cmd->cmd == IPCStats && reqs[i].cmd->argc == 0)) {
+            /* A client message has no way to carry the answer back */
+            fprintf(stderr, "%s needs berry's control socket\n", reqs[i].cmd->name);
+            rc = EXIT_FAILURE;
+            continue;
+        }
+        if (reqs[i].cmd->cmd == IPCNameDesktop) {
+            x_name_desktop(reqs[i].data[1], reqs[i].payload);
+            continue;
+        }
+        if (reqs[i].cmd->cmd == IPCSetFont)
+            x_set_font(reqs[i].payload);
+        memcpy(&records[count++ * IPC_RECORD_LEN], reqs[i].data, sizeof reqs[i].data);
+    }
+
+    memset(&ev, 0, sizeof ev);
+    ev.xclient.type = ClientMessage;
+    ev.xclient.window = root;
+    ev.xclient.format = 32;
+
+    if (count == 1) {
+        ev.xclient.message_type = XInternAtom(display, BERRY_CLIENT_EVENT, False);
+        memcpy(ev.xclient.data.l, records, IPC_RECORD_LEN * sizeof(long));
+        XSendEvent(display, root, false, SubstructureRedirectMask, &ev);
+    } else if (count > 1) {
+        batch = XInternAtom(display, BERRY_CLIENT_BATCH, False);
+        XChangeProperty(display, root, batch, XA_CARDINAL, 32, PropModeAppend,
+                (unsigned char *)records, count * IPC_RECORD_LEN);
+        ev.xclient.message_type = batch;
+        ev.xclient.data.l[0] = count;
+        XSendEvent(display, root, false, SubstructureRedirectMask, &ev);
     }
 
-    XSendEvent(display, root, false, SubstructureRedirectMask, &ev);
     XSync(display, false);
     XCloseDisplay(display);
+    free(records);
+    return rc;
+}
+
+/* Connect to berry's control socket, returns -1 if it is not listening */
+static int
+ipc_connect(void)
+{
+    struct sockaddr_un addr;
+    char path[MAXLEN];
+    int fd;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+
+    if (ipc_socket_path(path, sizeof path) < 0 || strlen(path) >= sizeof addr.sun_path)
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+ipc_write(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t r;
+
+    while (len > 0) {
+        r = send(fd, p, len, MSG_NOSIGNAL);
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int
+ipc_read(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t r;
+
+    while (len > 0) {
+        r = recv(fd, p, len, 0);
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* Send every request down the socket, then collect one reply for each.
+ * Any output a reply carries is printed to stdout.
+ */
+static int
+ipc_send(int fd, int n, struct request *reqs)
+{
+    struct ipc_request req;
+    struct ipc_reply rep;
+    char buf[IPC_MAX_PAYLOAD];
+    int rc = EXIT_SUCCESS;
+
+    for (int i = 0; i < n; i++) {
+        req.size = reqs[i].payload ? strlen(reqs[i].payload) : 0;
+        if (req.size > IPC_MAX_PAYLOAD)
+            req.size = IPC_MAX_PAYLOAD;
+        memcpy(req.data, reqs[i].data, sizeof req.data);
+        if (ipc_write(fd, &req, sizeof req) < 0 || ipc_write(fd, reqs[i].payload, req.size) < 0)
+            return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (ipc_read(fd, &rep, sizeof rep) < 0)
+            return EXIT_FAILURE;
+
+        while (rep.size > 0) {
+            size_t len = MIN(rep.size, sizeof buf);
+            if (ipc_read(fd, buf, len) < 0)
+                return EXIT_FAILURE;
+            fwrite(buf, 1, len, stdout);
+            rep.size -= len;
+        }
+
+        if (rep.status == IPCStatusUnknown) {
+            fprintf(stderr, "berry does not understand %s\n", reqs[i].cmd->name);
+            rc = EXIT_FAILURE;
+        } else if (rep.status != IPCStatusOk) {
+            fprintf(stderr, "berry could not carry out %s\n", reqs[i].cmd->name);
+            rc = EXIT_FAILURE;
+        }
+    }
+
+    return rc;
+}
+
+/* Send the given requests over the control socket, falling back to
+ * X client messages when berry is not listening on one.
+ */
+static int
+send_requests(int n, struct request *reqs)
+{
+    int fd, rc;
+
+    if (n == 0)
+        return EXIT_SUCCESS;
+
+    fd = ipc_connect();
+    if (fd < 0)
+        return x_send(n, reqs);
+
+    rc = ipc_send(fd, n, reqs);
+    close(fd);
+    return rc;
+}
+
+/* Ask berry for the given events, all of them if none are named, and
+ * copy the stream to stdout until berry goes away.
+ */
+static int
+subscribe(int argc, char **argv)
+{
+    static const char *names[IPCEventLast] = IPC_EVENT_NAMES;
+    struct ipc_request req;
+    struct ipc_reply rep;
+    char buf[IPC_MAX_PAYLOAD];
+    long mask = 0;
+    ssize_t r;
+    int fd;
+
+    for (int i = 0; i < argc; i++) {
+        int k = 0;
+        while (k < IPCEventLast && strcmp(argv[i], names[k]) != 0)
+            k++;
+        if (k == IPCEventLast) {
+            fprintf(stderr, "Unknown event %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        mask |= 1L << k;
+    }
+    if (mask == 0)
+        mask = (1L << IPCEventLast) - 1;
+
+    fd = ipc_connect();
+    if (fd < 0) {
+        fprintf(stderr, "subscribe needs berry's control socket\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(&req, 0, sizeof req);
+    req.data[0] = IPCSubscribe;
+    req.data[1] = mask;
+    if (ipc_write(fd, &req, sizeof req) < 0 || ipc_read(fd, &rep, sizeof rep) < 0 ||
+            rep.status != IPCStatusOk) {
+        fprintf(stderr, "berry refused the subscription\n");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    while ((r = recv(fd, buf, sizeof buf, 0)) > 0) {
+        fwrite(buf, 1, r, stdout);
+        fflush(stdout);
+    }
+
+    close(fd);
+    return EXIT_SUCCESS;
+}
+
+/* Send many commands over a single connection. Each command string is
+ * split on whitespace into a command name and its arguments.
+ */
+static int
+send_batch(int count, char **cmds)
+{
+    struct request *reqs;
+    char **lines;
+    int n, rc;
+
+    reqs = calloc(count > 0 ? count : 1, sizeof *reqs);
+    lines = calloc(count > 0 ? count : 1, sizeof *lines);
+    if (reqs == NULL || lines == NULL) {
+        free(reqs);
+        free(lines);
+        return EXIT_FAILURE;
+    }
+
+    n = 0;
+    rc = EXIT_SUCCESS;
+    for (int i = 0; i < count; i++) {
+        char *args[IPC_BATCH_MAX_ARGS + 1];
+        char *tok;
+        const struct command *c;
+        int c_argc;
+
+        /* The requests point into the line, keep it until they are sent */
+        lines[i] = strdup(cmds[i]);
+        if (lines[i] == NULL)
+            continue;
+
+        c_argc = -1;
+        for (char *s = lines[i]; (tok = next_arg(&s)) != NULL && c_argc < IPC_BATCH_MAX_ARGS;)
+            args[++c_argc] = tok;
+
+        if (c_argc >= 0 && (c = find_command(args[0], c_argc)) != NULL)
+            encode_command(c, c_argc, args + 1, &reqs[n++]);
+        else if (c_argc >= 0)
+            rc = EXIT_FAILURE;
+    }
+
+    if (send_requests(n, reqs) != EXIT_SUCCESS)
+        rc = EXIT_FAILURE;
+
+    for (int i = 0; i < count; i++)
+        free(lines[i]);
+    free(lines);
+    free(reqs);
+    return rc;
+}
+
+/* Split off the next blank separated argument of a batch line, in place.
+ * Single or double quotes keep blanks inside an argument, as in
+ * set_font "Monospace 10", and are removed.
+ */
+static char *
+next_arg(char **s)
+{
+    char *p = *s + strspn(*s, " \t"), *arg = p, *out = p;
+    char quote = 0;
+
+    if (*p == '\0')
+        return NULL;
+
+    for (; *p != '\0'; p++) {
+        if (quote != 0 && *p == quote)
+            quote = 0;
+        else if (quote == 0 && (*p == '"' || *p == '\''))
+            quote = *p;
+        else if (quote == 0 && (*p == ' ' || *p == '\t'))
+            break;
+        else
+            *out++ = *p;
+    }
+
+    *s = *p != '\0' ? p + 1 : p;
+    *out = '\0';
+    return arg;
+}
+
+/* Read one command per line from the given stream and send them as one
+ * batch. Blank lines and lines starting with '#' are skipped.
+ */
+static int
+read_batch(FILE *in)
+{
+    char buf[MAXLEN * 4];
+    char **cmds = NULL, **tmp;
+    int count = 0, size = 0, rc;
+
+    while (fgets(buf, sizeof buf, in) != NULL) {
+        char *line = buf + strspn(buf, " \t");
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        if (count == size) {
+            size = size == 0 ? 16 : size * 2;
+            tmp = realloc(cmds, size * sizeof(char *));
+            if (tmp == NULL)
+                break;
+            cmds = tmp;
+        }
+        cmds[count] = strdup(line);
+        if (cmds[count] != NULL)
+            count++;
+    }
+
+    rc = send_batch(count, cmds);
+    for (int i = 0; i < count; i++)
+        free(cmds[i]);
+    free(cmds);
+    return rc;
 }
 
 int
 main(int argc, char **argv)
 {
-    int c, c_argc;
+    int c, c_argc, rc;
     char **c_argv;
+    const struct command *cmd;
+    struct request req;
 
     c_argc = argc - 2;
     c_argv = argv + 2;
@@ -284,18 +762,26 @@ main(int argc, char **argv)
         }
     }
 
-    for (int i = 0; i < (int)(sizeof command_table / sizeof command_table[0]); i++) {
-        if (strcmp(argv[1], command_table[i].name) == 0) {
-            if (command_table[i].argc != c_argc) {
-                printf("Wrong number of arguments\n");
-                printf("%d expected for command %s\n", command_table[i].argc, command_table[i].name);
-                return EXIT_FAILURE;
-            }
-            send_command(&command_table[i], c_argc, c_argv);
-            return EXIT_SUCCESS;
-        }
+    if (argc < 2)
+        usage(stderr);
+
+    cmd = NULL;
+    if (strcmp(argv[1], "-") != 0 && strcmp(argv[1], "batch") != 0 && strcmp(argv[1], "subscribe") != 0) {
+        cmd = find_command(argv[1], c_argc);
+        if (cmd == NULL)
+            return EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[1], "-") == 0) {
+        rc = read_batch(stdin);
+    } else if (strcmp(argv[1], "batch") == 0) {
+        rc = send_batch(c_argc, c_argv);
+    } else if (strcmp(argv[1], "subscribe") == 0) {
+        rc = subscribe(c_argc, c_argv);
+    } else {
+        encode_command(cmd, c_argc, c_argv, &req);
+        rc = send_requests(1, &req);
     }
 
-    fprintf(stderr, "Command not found %s, exiting\n", argv[1]);
-    return EXIT_FAILURE;
+    return rc;
 }
@@ -1,22 +1,24 @@
 #!/bin/bash
 
-
+# Send all settings in one batch so berry only refreshes once
+berryc - <<EOC
 # Set decoration geometry
-berryc border_width       5
-berryc inner_border_width 3
-berryc title_height       30
-berryc top_gap            30
+border_width       5
+inner_border_width 3
+title_height       30
+top_gap            30
 
 # Set decoration colors
-berryc focus_color         292D3E
-berryc unfocus_color       292D3E
-berryc inner_focus_color   FFCB6B
-berryc inner_unfocus_color 565679
-berryc text_focus_color    ffffff
-berryc text_unfocus_color  eeeeee
+focus_color         292D3E
+unfocus_color       292D3E
+inner_focus_color   FFCB6B
+inner_unfocus_color 565679
+text_focus_color    ffffff
+text_unfocus_color  eeeeee
 
 # Other options
-berryc smart_place "true"
-berryc draw_text   "true"
-berryc edge_lock   "true"
-berryc set_font    "Dina-9"
+smart_place true
+draw_text   true
+edge_lock   true
+set_font    Dina-9
+EOC
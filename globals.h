@@ -16,6 +16,26 @@
 #define MAXLEN 256
 #define MINIMUM_DIM 30
 #define TITLE_X_OFFSET 5
-#define DEFAULT_ALPHA 0xffff
+#define WIN_INDEX_INITIAL 64
+#define EVENT_BATCH_MAX 256
+#define TITLE_PIXMAP_STEP 256
+#define CLIENT_LIST_INITIAL 64
+#define IPC_BATCH_MAX_LONGS 0x10000
+#define IPC_BATCH_MAX_ARGS 8
+#define IPC_MAX_CONN 16
+#define IPC_MAX_BUFFER 0x100000
+#define IPC_SUB_MAX_BUFFER 0x10000 /* events queued for one subscriber */
+#define IPC_MAX_SUB 8 /* subscribers, the other connections stay free for requests */
+#define DEFAULT_REFRESH_RATE 60
+#define OUTLINE_WIDTH 2
+#define SYNC_TIMEOUT 100
+#define CLIENT_SLAB 32
+#define TITLE_BUCKETS 256
+#define TITLE_MAX 512
+#define RES_CACHE_MAX 8 /* unused fonts and colors kept around for reuse */
+#define CONFIG_COALESCE 10 /* ms a config change waits for others before applying */
+#define CONFIG_TXN_TIMEOUT 5000 /* ms before a config transaction applies uncommitted */
+#define TRACE_RING_SIZE 4096 /* power of two */
+#define WORKSPACE_MAX 1024 /* upper bound for berryc workspace_count */
 
 #endif
@@ -1,9 +1,106 @@
 #ifndef _BERRY_IPC_H_
 #define _BERRY_IPC_H_
 
+#include <stdint.h>
+
 #define BERRY_CLIENT_EVENT "BERRY_CLIENT_EVENT"
 #define BERRY_FONT_PROPERTY "BERRY_FONT_PROPERTY"
 #define BERRY_WINDOW_STATUS "BERRY_WINDOW_STATUS"
+#define BERRY_CLIENT_BATCH "BERRY_CLIENT_BATCH"
+
+/* Number of longs making up one command, both in a ClientMessage and
+ * in each record of a BERRY_CLIENT_BATCH property */
+#define IPC_RECORD_LEN 5
+
+/* Unix socket protocol. Every request is a struct ipc_request followed
+ * by size bytes of string argument, every request is answered by a
+ * struct ipc_reply followed by size bytes of output.
+ */
+#define BERRY_SOCKET_ENV "BERRY_SOCKET"
+#define BERRY_SOCKET_PREFIX "berry-"
+#define IPC_MAX_PAYLOAD 4096
+
+/* Shared memory status, published while shm_status is on. The segment
+ * is named by ipc_shm_name, e.g. /dev/shm/berry-:0, and holds one
+ * struct berry_shm. seq is odd while berry writes it: readers copy the
+ * segment and keep the copy if seq was even and the same before and
+ * after. berry also does a FUTEX_WAKE on seq after each change.
+ */
+#define BERRY_SHM_PREFIX "/berry-"
+#define BERRY_SHM_VERSION 1
+#define BERRY_SHM_WORKSPACES 1024
+#define BERRY_SHM_MONITORS 16
+#define BERRY_SHM_WINDOWS 512
+
+/* Events of berryc subscribe. Once IPCSubscribe is answered the
+ * connection carries one JSON object per line, {"event":name,...}, and
+ * any further requests on it are ignored. */
+enum IPCEvent
+{
+    IPCEventFocus,
+    IPCEventWorkspace,
+    IPCEventMap,
+    IPCEventUnmap,
+    IPCEventGeometry,
+    IPCEventTitle,
+    IPCEventLast
+};
+
+#define IPC_EVENT_NAMES { "focus", "ws", "map", "unmap", "geometry", "title" }
+
+enum BerryShmState
+{
+    BerryShmNormal,
+    BerryShmHidden,
+    BerryShmMono,
+    BerryShmFullscreen
+};
+
+struct berry_shm_monitor
+{
+    int32_t screen, x, y, width, height;
+};
+
+struct berry_shm_window
+{
+    uint32_t window;
+    int32_t ws, monitor;
+    int32_t x, y, width, height;
+    uint32_t state; /* enum BerryShmState */
+    uint32_t decorated;
+};
+
+struct berry_shm
+{
+    uint32_t seq;
+    uint32_t version, size; /* BERRY_SHM_VERSION, sizeof(struct berry_shm) */
+    int32_t curr_ws, ws_count;
+    uint32_t focused; /* window, 0 if none */
+    uint32_t occupied[BERRY_SHM_WORKSPACES / 32]; /* bit per workspace holding windows */
+    int32_t monitor_count;
+    int32_t window_count, window_total; /* listed and managed, the list is cut at BERRY_SHM_WINDOWS */
+    struct berry_shm_monitor monitors[BERRY_SHM_MONITORS];
+    struct berry_shm_window windows[BERRY_SHM_WINDOWS];
+};
+
+struct ipc_request
+{
+    unsigned int size;
+    long data[IPC_RECORD_LEN];
+};
+
+struct ipc_reply
+{
+    int status;
+    unsigned int size;
+};
+
+enum IPCStatus
+{
+    IPCStatusOk,
+    IPCStatusUnknown,
+    IPCStatusError
+};
 
 enum IPCCommand
 {
@@ -56,9 +153,50 @@ enum IPCCommand
     IPCPointerInterval,
     IPCFocusFollowsPointer,
     IPCWarpPointer,
+    IPCTitlePixmap,
+    IPCQuery,
+    IPCDragMode,
+    IPCReparent,
+    IPCTrace,
+    IPCStats,
+    IPCWorkspaceCount,
+    IPCFocusDelay,
+    IPCShmStatus,
+    IPCSubscribe,
+    IPCConfigTransaction,
     IPCLast
 };
 
+/* What an IPCQuery asks for, the reply is a single JSON document */
+enum IPCQueryKind
+{
+    IPCQueryWindows,
+    IPCQueryWorkspaces,
+    IPCQueryMonitors,
+    IPCQueryFocused,
+    IPCQueryLast
+};
+
+/* How pointer drags move and resize clients */
+enum DragMode
+{
+    DragInterval, /* apply motion at most every pointer_interval ms */
+    DragAdaptive, /* apply the newest motion once per monitor frame */
+    DragOutline,  /* draw an outline, apply the geometry on release */
+    DragLast
+};
+
+/* Values of smart_place, false and true keep their old meaning */
+enum PlaceMode
+{
+    PlaceCenter,  /* always center new windows */
+    PlaceGrid,    /* scan a PLACE_RES grid for the lowest free spot */
+    PlaceFirst,   /* topmost, then leftmost, free rectangle that fits */
+    PlaceBest,    /* free rectangle leaving the shortest side over */
+    PlaceOverlap, /* best fit, or the spot covering the least of other windows */
+    PlaceLast
+};
+
 enum WindowType
 {
     Dock,
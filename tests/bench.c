@@ -0,0 +1,364 @@
+/* Copyright (c) 2018 Joshua L Ervin. All rights reserved. */
+/* Licensed under the MIT License. See the LICENSE file in the project root for full license information. */
+
+/* Benchmark driver, run by tests/bench.sh against a scratch X server with
+ * berry managing it. Each run performs one workload and prints a single
+ * JSON line describing it.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/Xatom.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+
+#include "globals.h"
+#include "ipc.h"
+#include "utils.h"
+
+#define BENCH_SWITCHES 200
+#define BENCH_TITLES 10 /* title changes per window */
+
+static Display *display;
+static Window root;
+static Atom net_wm_name, utf8string;
+
+static uint64_t now_usec(void);
+static Window *windows_create(int n);
+static void windows_destroy(Window *wins, int n);
+static void windows_map(Window *wins, int n);
+static void windows_unmap(Window *wins, int n);
+static void wait_events(int type, int count);
+static void barrier(void);
+static int ipc_connect(void);
+static int ipc_command(int fd, long cmd, long a, long b, int n);
+static void report(const char *name, int n, long ops, uint64_t usec, unsigned long requests);
+static int bench_map(int n);
+static int bench_title(int n);
+static int bench_workspace(int n);
+static int bench_drag(int n);
+static int bench_flood(int n);
+
+static uint64_t
+now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static Window *
+windows_create(int n)
+{
+    Window *wins = malloc(n * sizeof(Window));
+    if (wins == NULL)
+        exit(EXIT_FAILURE);
+
+    for (int i = 0; i < n; i++) {
+        wins[i] = XCreateSimpleWindow(display, root, 0, 0, 200, 150, 0, 0, 0);
+        XSelectInput(display, wins[i], StructureNotifyMask);
+    }
+    return wins;
+}
+
+static void
+windows_destroy(Window *wins, int n)
+{
+    for (int i = 0; i < n; i++)
+        XDestroyWindow(display, wins[i]);
+    XSync(display, True);
+    free(wins);
+}
+
+/* Map the windows and wait until berry has mapped each of them */
+static void
+windows_map(Window *wins, int n)
+{
+    for (int i = 0; i < n; i++)
+        XMapWindow(display, wins[i]);
+    XFlush(display);
+    wait_events(MapNotify, n);
+}
+
+static void
+windows_unmap(Window *wins, int n)
+{
+    for (int i = 0; i < n; i++)
+        XUnmapWindow(display, wins[i]);
+    XFlush(display);
+    wait_events(UnmapNotify, n);
+    barrier();
+}
+
+static void
+wait_events(int type, int count)
+{
+    XEvent ev;
+
+    while (count > 0) {
+        XNextEvent(display, &ev);
+        if (ev.type == type)
+            count--;
+    }
+}
+
+/* berry handles events in order, so once it has mapped a fresh window it
+ * has also handled everything we sent before it */
+static void
+barrier(void)
+{
+    Window w = XCreateSimpleWindow(display, root, 0, 0, 1, 1, 0, 0, 0);
+    XEvent ev;
+
+    XSelectInput(display, w, StructureNotifyMask);
+    XMapWindow(display, w);
+    XWindowEvent(display, w, StructureNotifyMask, &ev);
+    while (ev.type != MapNotify)
+        XWindowEvent(display, w, StructureNotifyMask, &ev);
+    XDestroyWindow(display, w);
+    XSync(display, False);
+}
+
+static int
+ipc_connect(void)
+{
+    struct sockaddr_un addr;
+    char path[MAXLEN];
+    int fd;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+
+    if (ipc_socket_path(path, sizeof path) < 0 || strlen(path) >= sizeof addr.sun_path)
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Send the same command n times back to back, then collect the replies */
+static int
+ipc_command(int fd, long cmd, long a, long b, int n)
+{
+    struct ipc_request req = { .size = 0, .data = { cmd, a, b, 0, 0 } };
+    struct ipc_reply rep;
+    char buf[IPC_MAX_PAYLOAD];
+
+    for (int i = 0; i < n; i++)
+        if (send(fd, &req, sizeof req, MSG_NOSIGNAL) != sizeof req)
+            return -1;
+
+    for (int i = 0; i < n; i++) {
+        if (recv(fd, &rep, sizeof rep, MSG_WAITALL) != sizeof rep)
+            return -1;
+        while (rep.size > 0) {
+            ssize_t r = recv(fd, buf, MIN(rep.size, sizeof buf), 0);
+            if (r <= 0)
+                return -1;
+            rep.size -= r;
+        }
+    }
+    return 0;
+}
+
+static void
+report(const char *name, int n, long ops, uint64_t usec, unsigned long requests)
+{
+    printf("{\"workload\":\"%s\",\"windows\":%d,\"ops\":%ld,\"usec\":%llu,\"usec_per_op\":%.2f,\"client_requests\":%lu}\n",
+            name, n, ops, (unsigned long long)usec, ops > 0 ? (double)usec / ops : 0.0, requests);
+}
+
+/* Map n windows and unmap them again */
+static int
+bench_map(int n)
+{
+    Window *wins = windows_create(n);
+    unsigned long req = NextRequest(display);
+    uint64_t start = now_usec();
+
+    windows_map(wins, n);
+    windows_unmap(wins, n);
+
+    report("map", n, 2L * n, now_usec() - start, NextRequest(display) - req);
+    windows_destroy(wins, n);
+    return EXIT_SUCCESS;
+}
+
+/* Rename every window BENCH_TITLES times as fast as we can */
+static int
+bench_title(int n)
+{
+    Window *wins = windows_create(n);
+    char title[64];
+
+    windows_map(wins, n);
+
+    unsigned long req = NextRequest(display);
+    uint64_t start = now_usec();
+    for (int r = 0; r < BENCH_TITLES; r++) {
+        for (int i = 0; i < n; i++) {
+            int len = snprintf(title, sizeof title, "bench window %d title %d", i, r);
+            XChangeProperty(display, wins[i], net_wm_name, utf8string, 8, PropModeReplace,
+                    (unsigned char *)title, len);
+        }
+    }
+    barrier();
+
+    report("title", n, (long)n * BENCH_TITLES, now_usec() - start, NextRequest(display) - req);
+    windows_destroy(wins, n);
+    return EXIT_SUCCESS;
+}
+
+/* Switch between a workspace holding n windows and an empty one */
+static int
+bench_workspace(int n)
+{
+    Window *wins = windows_create(n);
+    int fd = ipc_connect();
+
+    if (fd < 0) {
+        fprintf(stderr, "bench: cannot reach berry's control socket\n");
+        return EXIT_FAILURE;
+    }
+
+    ipc_command(fd, IPCSwitchWorkspace, 0, 0, 1);
+    windows_map(wins, n);
+
+    uint64_t start = now_usec();
+    for (int i = 0; i < BENCH_SWITCHES; i++)
+        if (ipc_command(fd, IPCSwitchWorkspace, (i + 1) % 2, 0, 1) < 0)
+            return EXIT_FAILURE;
+    barrier();
+
+    report("workspace", n, BENCH_SWITCHES, now_usec() - start, 0);
+    close(fd);
+    windows_destroy(wins, n);
+    return EXIT_SUCCESS;
+}
+
+/* Move a window with the pointer by n steps, holding the move modifier */
+static int
+bench_drag(int n)
+{
+    Window *wins = windows_create(1);
+    XWindowAttributes wa;
+    Window child;
+    int x, y, ev, er, major, minor;
+
+    if (!XTestQueryExtension(display, &ev, &er, &major, &minor)) {
+        fprintf(stderr, "bench: the X server has no XTest\n");
+        return EXIT_FAILURE;
+    }
+
+    windows_map(wins, 1);
+    barrier();
+    XGetWindowAttributes(display, wins[0], &wa);
+    XTranslateCoordinates(display, wins[0], root, wa.width / 2, wa.height / 2, &x, &y, &child);
+
+    KeyCode mod = XKeysymToKeycode(display, XK_Super_L);
+    unsigned long req = NextRequest(display);
+    uint64_t start = now_usec();
+
+    XTestFakeMotionEvent(display, -1, x, y, CurrentTime);
+    XTestFakeKeyEvent(display, mod, True, CurrentTime);
+    XTestFakeButtonEvent(display, 1, True, CurrentTime);
+    for (int i = 1; i <= n; i++)
+        XTestFakeMotionEvent(display, -1, x + i % 400, y + i % 300, CurrentTime);
+    XTestFakeButtonEvent(display, 1, False, CurrentTime);
+    XTestFakeKeyEvent(display, mod, False, CurrentTime);
+    barrier();
+
+    report("drag", 1, n, now_usec() - start, NextRequest(display) - req);
+    windows_destroy(wins, 1);
+    return EXIT_SUCCESS;
+}
+
+/* Pipeline n window moves each way down a single socket connection */
+static int
+bench_flood(int n)
+{
+    Window *wins = windows_create(1);
+    int fd = ipc_connect();
+
+    if (fd < 0) {
+        fprintf(stderr, "bench: cannot reach berry's control socket\n");
+        return EXIT_FAILURE;
+    }
+
+    windows_map(wins, 1);
+
+    uint64_t start = now_usec();
+    if (ipc_command(fd, IPCWindowMoveRelative, 1, 0, n) < 0 ||
+            ipc_command(fd, IPCWindowMoveRelative, -1, 0, n) < 0)
+        return EXIT_FAILURE;
+    barrier();
+
+    report("flood", 1, 2L * n, now_usec() - start, 0);
+    close(fd);
+    windows_destroy(wins, 1);
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        int (*run)(int);
+    } workloads[] = {
+        { "map",       bench_map       },
+        { "title",     bench_title     },
+        { "workspace", bench_workspace },
+        { "drag",      bench_drag      },
+        { "flood",     bench_flood     },
+    };
+    int n;
+
+    if (argc != 3 || (n = atoi(argv[2])) <= 0) {
+        fprintf(stderr, "usage: bench map|title|workspace|drag|flood n\n");
+        return EXIT_FAILURE;
+    }
+
+    display = XOpenDisplay(NULL);
+    if (display == NULL) {
+        fprintf(stderr, "bench: cannot open display\n");
+        return EXIT_FAILURE;
+    }
+    root = DefaultRootWindow(display);
+    net_wm_name = XInternAtom(display, "_NET_WM_NAME", False);
+    utf8string = XInternAtom(display, "UTF8_STRING", False);
+
+    for (int i = 0; i < (int)(sizeof workloads / sizeof workloads[0]); i++) {
+        if (strcmp(argv[1], workloads[i].name) == 0) {
+            int rc = workloads[i].run(n);
+            XCloseDisplay(display);
+            return rc;
+        }
+    }
+
+    fprintf(stderr, "bench: unknown workload %s\n", argv[1]);
+    XCloseDisplay(display);
+    return EXIT_FAILURE;
+}
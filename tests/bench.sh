@@ -0,0 +1,64 @@
+#!/bin/bash
+#
+# Start berry on a scratch Xvfb server and run every workload of the
+# bench driver against it, printing one JSON line per workload with
+# berry's own CPU time and X requests added. Run through "make bench".
+#
+# BENCH_DISPLAY picks the display [99], N the size of each workload [50].
+
+: "${BERRY:?}" "${BERRYC:?}" "${BENCH:?}"
+
+dpy=":${BENCH_DISPLAY:-99}"
+n="${N:-50}"
+tmp=$(mktemp -d)
+export BERRY_SOCKET="$tmp/berry.sock"
+
+cleanup() {
+    [ -n "$wm" ] && kill "$wm" 2>/dev/null
+    [ -n "$xvfb" ] && kill "$xvfb" 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+# utime + stime of a process, in clock ticks
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+Xvfb "$dpy" -screen 0 1920x1080x24 -nolisten tcp 2>/dev/null &
+xvfb=$!
+export DISPLAY="$dpy"
+for _ in $(seq 50); do
+    [ -e "/tmp/.X11-unix/X${dpy#:}" ] && break
+    sleep 0.1
+done
+
+# An empty autostart so nothing but the bench draws on the server
+: > "$tmp/autostart"
+chmod +x "$tmp/autostart"
+"$BERRY" -c "$tmp/autostart" &
+wm=$!
+for _ in $(seq 50); do
+    [ -S "$BERRY_SOCKET" ] && break
+    sleep 0.1
+done
+if [ ! -S "$BERRY_SOCKET" ]; then
+    echo "bench: berry did not start" >&2
+    exit 1
+fi
+
+hz=$(getconf CLK_TCK)
+status=0
+for w in map title workspace drag flood; do
+    "$BERRYC" stats reset
+    before=$(cpu_ticks "$wm")
+    if ! line=$("$BENCH" "$w" "$n"); then
+        status=1
+        continue
+    fi
+    after=$(cpu_ticks "$wm")
+    requests=$("$BERRYC" stats | grep -o '"requests":[0-9]*' | awk -F: '{ s += $2 } END { print s + 0 }')
+    echo "${line%\}},\"wm_cpu_ms\":$(( (after - before) * 1000 / hz )),\"wm_requests\":$requests}"
+done
+exit $status
@@ -4,6 +4,9 @@
 #include "config.h"
 
 #include <X11/Xlib.h>
+#include <X11/Xft/Xft.h>
+#include <X11/extensions/sync.h>
+#include <xcb/xcb.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -13,20 +16,177 @@ struct client_geom {
     int x, y, width, height;
 };
 
+/* An interned, length-prefixed title, shared by all clients showing it */
+struct title {
+    struct title *next; /* next in its title_table bucket */
+    unsigned int hash, refs;
+    size_t len;
+    char str[];
+};
+
 struct client {
+    /* Read by the loops over a whole workspace, kept together up front */
+    struct client *next, *c_prev; /* stacking order, see c_list */
+    struct client *f_next, *f_prev; /* focus order, see f_list */
+    struct client_geom geom;
     Window window, dec;
     int ws, x_hide;
     bool decorated, hidden, fullscreen, mono, was_fs;
-    struct client_geom geom;
+    bool framed; /* the window is reparented into dec rather than its sibling */
+    bool mapped; /* we have mapped the window, reparenting it now costs an UnmapNotify */
+    /* Everything below is only used for one client at a time */
+    int ignore_unmap; /* UnmapNotify events caused by our own reparenting */
+    unsigned int protocols; /* WM_PROTOCOLS as Proto* bits, valid if p_valid */
+    bool p_valid;
     struct client_geom prev;
-    struct client *next, *f_next;
+    struct client_geom w_sent, d_sent; /* last geometry sent for window and dec, zero width if unknown */
+    /* _NET_WM_SYNC_REQUEST state, sync_counter is None if unsupported */
+    XSyncCounter sync_counter;
+    XSyncAlarm sync_alarm;
+    XSyncValue sync_value; /* last value asked for */
+    Time sync_time; /* when it was asked for */
+    bool sync_wait; /* the client has not caught up with it yet */
+    /* Position the client is filed under in its workspace's ws_index */
+    int i_x, i_y;
+    bool indexed;
+    struct client_geom p_cells; /* cells counted in the placement grid, zero width if none */
+    struct title *title;
+    XftDraw *draw; /* drawing context for the decoration window */
+    /* Title layout cache, valid for the current title, t_font and t_width */
+    XftFont *t_font;
+    XGlyphInfo t_extents; /* extents of the truncated title */
+    int t_width, t_len, t_ascent;
+    bool t_valid;
+    /* Pre-rendered title bars, indexed by focus state */
+    Pixmap t_pm[2];
+    unsigned long t_pm_gen[2]; /* title_gen when rendered, 0 if stale */
+    int t_pm_w[2]; /* width rendered into each pixmap */
+    int t_pm_cap, t_pm_h; /* allocated pixmap size */
+    /* Last BERRY_WINDOW_STATUS written, republished when dirty */
+    struct client *s_next; /* next client on the dirty status list */
+    bool s_dirty;
+    int s_len;
+    char status[512];
+};
+
+/* A font opened by name, shared while set_font keeps asking for it */
+struct font_entry {
+    struct font_entry *next;
+    unsigned int refs;
+    XftFont *font;
+    char name[];
+};
+
+/* An allocated text color, keyed by its color spec */
+struct color_entry {
+    struct color_entry *next;
+    unsigned int refs;
+    XftColor color;
+    char spec[];
+};
+
+/* CLIENT_SLAB clients at a time, handed out by client_alloc */
+struct client_slab {
+    struct client_slab *next;
+    struct client clients[];
+};
+
+/* State of a pointer drag started on a client */
+struct drag {
+    int x, y; /* pointer position at the button press */
+    struct client_geom orig; /* client geometry at the button press */
+    struct client_geom outline; /* geometry shown by the outline in DragOutline */
+    XMotionEvent deferred; /* resize held back until the client catches up */
+    bool has_deferred;
+    uint64_t deferred_due; /* CLOCK_MONOTONIC usec at which deferred is sent anyway */
+};
+
+/* One entry of the trace ring, see LOGT */
+struct trace_record {
+    uint64_t usec; /* CLOCK_MONOTONIC */
+    unsigned long window;
+    int type; /* X event type */
+};
+
+/* Dispatch counters for one event type or berryc command */
+struct stats_entry {
+    unsigned long count;
+    unsigned long requests; /* X requests made while handling it */
+    uint64_t usec, max_usec;
+    unsigned long hist[20]; /* handled in under 2^(i+1) microseconds */
+};
+
+/* Growable byte buffer */
+struct strbuf {
+    char *buf;
+    size_t len, size;
+};
+
+/* A connection to the control socket */
+struct ipc_conn {
+    int fd;
+    struct strbuf in, out;
+    unsigned int events; /* IPCEvent bits subscribed to, 0 for requests */
+    unsigned long dropped; /* events lost since the reader fell behind */
+};
+
+/* Requests sent for a window before managing it, attr and geom are
+ * only asked for while adopting existing windows */
+struct manage_cookies {
+    xcb_get_window_attributes_cookie_t attr;
+    xcb_get_geometry_cookie_t geom;
+    xcb_get_property_cookie_t type, class, desktop, name, protocols, counter;
+};
+
+/* What the replies to manage_cookies said */
+struct manage_props {
+    Atom type; /* None if unset */
+    int desktop; /* -1 if unset */
+    bool has_title;
     char title[512];
+    unsigned int protocols; /* Proto* bits */
+    XSyncCounter counter;
+};
+
+/* Clients of a workspace sorted by position, for directional lookups */
+struct ws_index {
+    struct client **by_x, **by_y;
+    int count, size;
+};
+
+/* Occupancy of a workspace's monitor in PLACE_RES sized cells. It is
+ * brought up to date from the clients' geometry when a window is placed.
+ */
+struct place_grid {
+    int x, y, width, height; /* monitor area in cells */
+    uint16_t *cells; /* number of clients covering each cell */
+    uint16_t *run; /* free cells above each column in the row being scanned */
+};
+
+/* Maximal free rectangles of a workspace's monitor, in pixels. They are
+ * rebuilt from the clients' geometry on the first placement after any
+ * of them changed.
+ */
+struct place_rects {
+    struct client_geom area; /* monitor minus gaps the rects were built for */
+    struct client_geom *rects;
+    int count, size;
+    struct client *skip; /* client left out of the build */
+    bool dirty;
+};
+
+/* Slot in the open addressing table mapping X windows to clients */
+struct win_entry {
+    Window window;
+    struct client *c;
 };
 
 struct config {
-    int b_width, i_width, t_height, top_gap, bot_gap, left_gap, right_gap, r_step, m_step, move_mask, resize_mask, pointer_interval;
+    int b_width, i_width, t_height, top_gap, bot_gap, left_gap, right_gap, r_step, m_step, move_mask, resize_mask, pointer_interval, focus_delay;
+    int drag_mode;
     unsigned long bf_color, bu_color, if_color, iu_color;
-    bool focus_new, focus_motion, edge_lock, t_center, smart_place, draw_text, json_status, decorate, fs_remove_dec, fs_max;
+    int smart_place;
+    bool focus_new, focus_motion, edge_lock, t_center, draw_text, json_status, shm_status, decorate, fs_remove_dec, fs_max, t_pixmap, reparent;
     bool follow_pointer, warp_pointer;
     bool manage[WindowLast];
 };
@@ -35,6 +195,13 @@ struct monitor {
     int x, y, width, height, screen;
 };
 
+/* WM_PROTOCOLS we take part in, as cached in client->protocols */
+enum protocols {
+    ProtoDeleteWindow = 1 << 0,
+    ProtoTakeFocus    = 1 << 1,
+    ProtoSyncRequest  = 1 << 2,
+};
+
 enum atoms_net {
     NetSupported,
     NetNumberOfDesktops,
@@ -57,6 +224,8 @@ enum atoms_net {
     NetWMMoveResize,
     NetDesktopNames,
     NetDesktopViewport,
+    NetWMSyncRequest,
+    NetWMSyncRequestCounter,
     NetLast
 };
 
@@ -71,6 +240,7 @@ enum berry_net {
     BerryWindowStatus,
     BerryClientEvent,
     BerryFontProperty,
+    BerryClientBatch,
     BerryLast
 };
 
@@ -1,6 +1,7 @@
 #include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 int
 asprintf(char **buf, const char *fmt, ...)
@@ -34,3 +35,136 @@ vasprintf(char **buf, const char *fmt, va_list args)
 	size = vsprintf(*buf, fmt, args);
 	return size;
 }
+
+static int
+sb_reserve(struct strbuf *sb, size_t len)
+{
+	size_t size;
+	char *tmp;
+
+	if (sb->len + len <= sb->size)
+		return 0;
+
+	size = sb->size == 0 ? 256 : sb->size;
+	while (size < sb->len + len)
+		size *= 2;
+
+	tmp = realloc(sb->buf, size);
+	if (tmp == NULL)
+		return -1;
+
+	sb->buf = tmp;
+	sb->size = size;
+	return 0;
+}
+
+int
+sb_append(struct strbuf *sb, const void *data, size_t len)
+{
+	if (sb_reserve(sb, len) < 0)
+		return -1;
+
+	memcpy(sb->buf + sb->len, data, len);
+	sb->len += len;
+	return 0;
+}
+
+/* Append formatted text, keeping the buffer NUL terminated */
+int
+sb_printf(struct strbuf *sb, const char *fmt, ...)
+{
+	va_list args;
+	int size;
+
+	va_start(args, fmt);
+	size = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+
+	if (size < 0 || sb_reserve(sb, size + 1) < 0)
+		return -1;
+
+	va_start(args, fmt);
+	vsnprintf(sb->buf + sb->len, size + 1, fmt, args);
+	va_end(args);
+	sb->len += size;
+	return size;
+}
+
+/* Drop the first len bytes of the buffer */
+void
+sb_consume(struct strbuf *sb, size_t len)
+{
+	if (len >= sb->len) {
+		sb->len = 0;
+		return;
+	}
+
+	memmove(sb->buf, sb->buf + len, sb->len - len);
+	sb->len -= len;
+}
+
+void
+sb_free(struct strbuf *sb)
+{
+	free(sb->buf);
+	sb->buf = NULL;
+	sb->len = sb->size = 0;
+}
+
+/* Work out where the berry control socket lives for the current display.
+ * $BERRY_SOCKET wins, otherwise a per-display name is used inside
+ * $XDG_RUNTIME_DIR, falling back to /tmp.
+ */
+int
+ipc_socket_path(char *buf, size_t len)
+{
+	const char *env, *dir, *dpy;
+	int size;
+
+	env = getenv(BERRY_SOCKET_ENV);
+	if (env != NULL && env[0] != '\0')
+		return snprintf(buf, len, "%s", env) >= (int)len ? -1 : 0;
+
+	dir = getenv("XDG_RUNTIME_DIR");
+	if (dir == NULL || dir[0] == '\0')
+		dir = "/tmp";
+
+	dpy = getenv("DISPLAY");
+	if (dpy == NULL)
+		dpy = "";
+
+	size = snprintf(buf, len, "%s/" BERRY_SOCKET_PREFIX "%s.sock", dir, dpy);
+	if (size < 0 || size >= (int)len)
+		return -1;
+
+	/* DISPLAY may look like a path, keep the socket in dir */
+	for (char *p = buf + strlen(dir) + 1; *p != '\0'; p++)
+		if (*p == '/')
+			*p = '_';
+
+	return 0;
+}
+
+/* Name of the shared memory status segment for the current display, as
+ * given to shm_open */
+int
+ipc_shm_name(char *buf, size_t len)
+{
+	const char *dpy;
+	int size;
+
+	dpy = getenv("DISPLAY");
+	if (dpy == NULL)
+		dpy = "";
+
+	size = snprintf(buf, len, BERRY_SHM_PREFIX "%s", dpy);
+	if (size < 0 || size >= (int)len)
+		return -1;
+
+	/* Only the leading slash is allowed */
+	for (char *p = buf + 1; *p != '\0'; p++)
+		if (*p == '/')
+			*p = '_';
+
+	return 0;
+}
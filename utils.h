@@ -3,14 +3,46 @@
 
 #include "types.h"
 #include <stdarg.h>
+#include <stddef.h>
 
 #define MAX(a, b) ((a > b) ? (a) : (b))
 #define MIN(a, b) ((a < b) ? (a) : (b))
 #define UNUSED(x) (void)(x)
+
+/* Build time log levels, chosen with configure --loglevel=n. Anything
+ * above LOG_LEVEL compiles to nothing. */
+#define LOG_NONE  0
+#define LOG_DEBUG 1 /* LOGN and LOGP, printed when started with -d */
+#define LOG_TRACE 2 /* LOGT as well, recorded into the trace ring */
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_DEBUG
+#endif
+
+#if LOG_LEVEL >= LOG_DEBUG
 #define LOGN(msg)      do { if (debug) fprintf(stderr, __WINDOW_MANAGER_NAME__": " msg "\n"); } while (0)
 #define LOGP(msg, ...) do { if (debug) fprintf(stderr, __WINDOW_MANAGER_NAME__": " msg "\n", __VA_ARGS__); } while (0)
+#else
+/* Still type checked, but never emitted */
+#define LOGN(msg)      do { if (0) fprintf(stderr, msg "\n"); } while (0)
+#define LOGP(msg, ...) do { if (0) fprintf(stderr, msg "\n", __VA_ARGS__); } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_TRACE
+#define LOGT(type, window) trace_record(type, window)
+#else
+#define LOGT(type, window) do { (void)(type); (void)(window); } while (0)
+#endif
 
 int asprintf(char **buf, const char *fmt, ...);
 int vasprintf(char **buf, const char *fmt, va_list args);
 
+int sb_append(struct strbuf *sb, const void *data, size_t len);
+int sb_printf(struct strbuf *sb, const char *fmt, ...);
+void sb_consume(struct strbuf *sb, size_t len);
+void sb_free(struct strbuf *sb);
+
+int ipc_socket_path(char *buf, size_t len);
+int ipc_shm_name(char *buf, size_t len);
+
 #endif
@@ -3,12 +3,26 @@
 
 #include "config.h"
 
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <X11/Xatom.h>
@@ -16,9 +30,12 @@
 #include <X11/Xproto.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/Xinerama.h>
+#include <X11/extensions/Xrandr.h>
 #include <X11/extensions/shape.h>
 #include <X11/cursorfont.h>
 #include <X11/Xft/Xft.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
 
 #include "globals.h"
 #include "ipc.h"
@@ -26,11 +43,50 @@
 #include "utils.h"
 
 static struct client *f_client = NULL; /* focused client */
-static struct client *c_list[WORKSPACE_NUMBER]; /* 'stack' of managed clients in drawing order */
-static struct client *f_list[WORKSPACE_NUMBER]; /* ordered lists for clients to be focused */
+/* Per workspace state, ws_size entries of which ws_count are in use */
+static struct client **c_list = NULL; /* 'stack' of managed clients in drawing order */
+static struct client **c_tail = NULL; /* last of each c_list */
+static struct client_slab *client_slabs = NULL;
+static struct client *client_pool = NULL; /* unused clients, linked through next */
+static struct title *title_table[TITLE_BUCKETS];
+static struct title *title_none; /* the empty title, never released */
+static struct client **f_list = NULL; /* ordered lists for clients to be focused */
+static struct client **f_tail = NULL; /* last of each f_list */
+static struct client *s_list = NULL; /* clients whose status needs to be republished */
+static struct ws_index *ws_index = NULL;
+static struct place_grid *p_grid = NULL;
+static struct place_rects *p_rects = NULL;
+static int *ws_m_list = NULL; /* Mapping from workspaces to associated monitors */
+static int *ws_used = NULL; /* workspaces holding any clients, in no particular order */
+static int *ws_used_pos = NULL; /* index of each of those in ws_used */
+static int ws_used_count = 0;
+static int ws_count = 0;
+static int ws_size = 0;
+static Window *restack_wins = NULL; /* scratch list for ws_restack */
+static int restack_size = 0;
+static unsigned long enter_serial = 0; /* EnterNotify events older than this were caused by us */
+static struct client *focus_pending = NULL; /* entered by the pointer, focused at focus_due */
+static uint64_t focus_due = 0;
+static Window active_window = None; /* last value written to _NET_ACTIVE_WINDOW */
+static struct berry_shm *shm_status = NULL; /* mapped while conf.shm_status is on */
+static char shm_status_name[MAXLEN];
+static bool shm_dirty = false; /* shm_status needs to be republished */
+static GC outline_gc;
+static int frame_ms = 1000 / DEFAULT_REFRESH_RATE; /* duration of one monitor frame */
+static bool sync_supported = false;
+static int sync_event_base;
+static bool randr_supported = false;
+static int randr_event_base;
+static bool monitors_dirty = false; /* XRandR reported a change, monitors_setup is due */
 static struct monitor *m_list = NULL; /* All saved monitors */
+static struct win_entry *w_index = NULL; /* Mapping from client and decoration windows to clients */
+static unsigned int w_index_size = 0;
+static unsigned int w_index_count = 0;
+static Window *cl_windows = NULL; /* Managed windows in mapping order, mirrors _NET_CLIENT_LIST */
+static int cl_count = 0;
+static int cl_size = 0;
+static bool cl_dirty = false; /* _NET_CLIENT_LIST needs to be republished */
 static struct config conf; /* gloabl config */
-static int ws_m_list[WORKSPACE_NUMBER]; /* Mapping from workspaces to associated monitors */
 static int curr_ws = 0;
 static int m_count = 0;
 static Cursor move_cursor, normal_cursor;
@@ -38,15 +94,40 @@ static Display *display = NULL;
 static Atom net_atom[NetLast], wm_atom[WMLast], net_berry[BerryLast];
 static Window root, check, nofocus;
 static bool running = true;
+static struct config conf_applied; /* conf as the clients were last refreshed for */
+static unsigned long title_gen_applied;
+static bool config_staged = false; /* conf may differ from conf_applied */
+static bool config_txn = false; /* between berryc config begin and commit */
+static uint64_t config_due = 0; /* when the staged changes apply by themselves */
+static int ipc_fd = -1; /* listening control socket */
+static char ipc_path[MAXLEN];
+static struct ipc_conn ipc_conns[IPC_MAX_CONN];
+static const char *ipc_payload = NULL; /* string argument of the socket request being handled */
+static struct strbuf ipc_out; /* output of the socket request being handled */
+static struct ipc_conn *ipc_conn_current = NULL; /* where the request being handled came from */
+static struct strbuf event_line; /* members of the event being sent */
+static unsigned int event_mask = 0; /* IPCEvent bits any subscriber wants */
+static int ipc_status = IPCStatusOk;
 static bool debug = false;
+static struct stats_entry stats_event[LASTEvent + 1]; /* extension events share the last one */
+static struct stats_entry stats_ipc[IPCLast]; /* config commands are counted by their own number */
+#if LOG_LEVEL >= LOG_TRACE
+static struct trace_record trace_ring[TRACE_RING_SIZE];
+static unsigned int trace_head = 0; /* records written so far */
+static volatile sig_atomic_t trace_pending = 0; /* SIGUSR1 came in */
+#endif
 static int screen, display_width, display_height;
 static int (*xerrorxlib)(Display *, XErrorEvent *);
-static XftColor xft_focus_color, xft_unfocus_color;
+static struct color_entry *text_focus, *text_unfocus;
 static XftFont *font;
+static struct font_entry *font_res; /* the cache entry holding font */
+static struct font_entry *font_cache = NULL;
+static struct color_entry *color_cache = NULL;
 static char global_font[MAXLEN] = DEFAULT_FONT;
-static XRenderColor r_color;
 static GC gc;
+static unsigned long title_gen = 1; /* bumped whenever every rendered title goes stale */
 static Atom utf8string;
+static XEvent ev_batch[EVENT_BATCH_MAX]; /* events drained from the queue, dispatched together */
 
 /* All functions */
 
@@ -58,12 +139,32 @@ static void client_close(struct client *c);
 static void client_decorations_create(struct client *c);
 static void client_decorations_destroy(struct client *c);
 static void client_delete(struct client *c);
+static unsigned int configure_window(Window w, struct client_geom *sent, int x, int y, int width, int height);
 static void client_fullscreen(struct client *c, bool toggle, bool fullscreen, bool max);
 static void client_hide(struct client *c);
+static void client_set_hidden(struct client *c, bool hidden);
+static void ws_restack(int ws);
+static void ignore_enter_events(void);
 static void client_manage_focus(struct client *c);
+static void focus_pending_commit(void);
+static int focus_pending_timeout(void);
+static void client_configure_windows(struct client *c);
+static void client_send_configure(struct client *c);
+static void client_lock_move(struct client *c, struct client_geom *g, int x, int y);
+static void client_lock_resize(struct client *c, struct client_geom *g, int w, int h);
 static void client_move_absolute(struct client *c, int x, int y);
 static void client_move_relative(struct client *c, int x, int y);
 static void client_move_to_front(struct client *c);
+static void stack_push(struct client *c, int ws);
+static void stack_unlink(struct client *c);
+static void focus_push(struct client *c, int ws);
+static void focus_unlink(struct client *c);
+#ifndef NDEBUG
+static void ws_lists_check(int ws);
+#define WS_LISTS_CHECK(ws) ws_lists_check(ws)
+#else
+#define WS_LISTS_CHECK(ws) do { } while (0)
+#endif
 static void client_monocle(struct client *c);
 static void client_place(struct client *c);
 static void client_raise(struct client *c);
@@ -80,6 +181,12 @@ static void client_snap_left(struct client *c);
 static void client_snap_right(struct client *c);
 static void client_toggle_decorations(struct client *c);
 static void client_set_status(struct client *c);
+static void client_write_status(struct client *c);
+static void status_flush(void);
+static bool shm_status_open(void);
+static void shm_status_close(void);
+static void shm_status_flush(void);
+static void status_forget(struct client *c);
 
 /* EWMH functions */
 static void ewmh_set_fullscreen(struct client *c, bool fullscreen);
@@ -88,7 +195,11 @@ static void ewmh_set_focus(struct client *c);
 static void ewmh_set_desktop(struct client *c, int ws);
 static void ewmh_set_frame_extents(struct client *c);
 static void ewmh_set_client_list(void);
-static void ewmh_set_desktop_names(void);
+static void ewmh_flush_client_list(void);
+static void client_list_add(Window w);
+static void client_list_remove(Window w);
+static void ewmh_set_desktop_names(bool keep);
+static void ewmh_set_number_of_desktops(void);
 static void ewmh_set_active_desktop(int ws);
 
 /* Event handlers */
@@ -126,24 +237,128 @@ static void ipc_config(long *d);
 static void ipc_save_monitor(long *d);
 static void ipc_set_font(long *d);
 static void ipc_edge_gap(long *d);
+static void ipc_name_desktop(long *d);
+static void ipc_query(long *d);
+static void ipc_trace(long *d);
+static void ipc_stats(long *d);
+static void ipc_subscribe(long *d);
+static bool ipc_event_wanted(enum IPCEvent ev);
+static void ipc_event_send(enum IPCEvent ev);
+static void ipc_event_window(enum IPCEvent ev, struct client *c);
+static void ipc_events_flush(void);
+static void ipc_event_mask_update(void);
+static uint64_t now_usec(void);
+static void stats_add(struct stats_entry *s, uint64_t start, unsigned long request);
+static void stats_list(struct strbuf *sb, const char *key, struct stats_entry *s, int n);
+#if LOG_LEVEL >= LOG_TRACE
+static void trace_record(int type, unsigned long window);
+static void trace_dump(struct strbuf *sb);
+static void trace_signal(int sig);
+#endif
+static void ipc_dispatch(long *d);
+static void ipc_apply_batch(void);
+static void ipc_batch_end(void);
+static void ipc_config_transaction(long *d);
+static void config_stage(void);
+static void config_apply(void);
+static void config_pending_commit(void);
+static int config_pending_timeout(void);
+
+/* Control socket functions */
+static void ipc_socket_setup(void);
+static void query_string(struct strbuf *sb, const char *s);
+static void query_client(struct strbuf *sb, struct client *c);
+static void query_windows(struct strbuf *sb);
+static void query_workspaces(struct strbuf *sb);
+static void query_monitors(struct strbuf *sb);
+static void ipc_socket_close(void);
+static void ipc_wait(bool block);
+static void ipc_conn_accept(void);
+static void ipc_conn_close(struct ipc_conn *conn);
+static void ipc_conn_read(struct ipc_conn *conn);
+static void ipc_conn_write(struct ipc_conn *conn);
 
 static void monitors_free(void);
 static void monitors_setup(void);
+static void monitors_shift_client(struct client *c, int dx, int dy);
+static bool monitors_overlap(int x, int y, int w, int h);
+static void monitors_rate(void);
+static void drag_motion(struct client *c, struct drag *d, XMotionEvent *m);
+static void drag_outline(struct client_geom *g);
+static bool drag_wait(int ms);
+static Bool drag_event(Display *d, XEvent *e, XPointer arg);
+static void client_sync_setup(struct client *c);
+static void client_sync_free(struct client *c);
+static bool client_sync_request(struct client *c, Time t);
+static bool client_sync_alarm(struct client *c, XEvent *e);
+static void handle_extension_event(XEvent *e);
+
+/* Window index functions */
+static void win_index_insert(Window w, struct client *c);
+static struct client* win_index_lookup(Window w);
+static int ws_index_find(struct client **list, int n, int key, bool by_y);
+static void ws_index_shift(struct client **list, int n, struct client *c, int old, int key, bool by_y);
+static void ws_index_insert(int ws, struct client *c);
+static void ws_index_remove(struct client *c);
+static void ws_index_update(struct client *c);
+static struct client* ws_index_nearest(struct client *c, int dir);
+static bool place_grid_sync(struct client *c, int mon);
+static void place_grid_mark(struct place_grid *g, struct client_geom *cells, int delta);
+static void place_grid_forget(struct client *c);
+static void place_rects_dirty(int ws);
+static bool place_rects_push(struct place_rects *pr, struct client_geom r);
+static void place_rects_split(struct place_rects *pr, struct client_geom *used);
+static void place_rects_prune(struct place_rects *pr);
+static bool place_rects_sync(struct client *c, struct client_geom *area);
+static int place_overlap(struct client *c, int x, int y);
+static void client_place_grid(struct client *c);
+static void client_place_rects(struct client *c);
+static void win_index_remove(Window w, struct client *c);
 
 static void close_wm(void);
 static void draw_text(struct client *c, bool focused);
+static void draw_text_area(struct client *c, bool focused, int x, int y, int w, int h);
 static struct client* get_client_from_window(Window w);
-static void load_color(XftColor *dest_color, unsigned long raw_color);
+static bool load_color(struct color_entry **dest, unsigned long raw_color);
+static void load_font(const char *name);
+static struct font_entry *font_acquire(const char *name);
+static void font_release(struct font_entry *f);
+static struct color_entry *color_acquire(const char *spec);
+static void color_release(struct color_entry *c);
+static void res_cache_trim(void);
+static void res_cache_free(void);
 static void load_config(char *conf_path);
 static void manage_new_window(Window w, XWindowAttributes *wa);
+static bool manage_window_type(Atom type);
+static struct client *client_create(Window w, XWindowAttributes *wa, int ws, bool mapped, struct manage_props *p);
+static void manage_props_request(xcb_connection_t *xc, Window w, struct manage_cookies *ck);
+static void manage_props_collect(xcb_connection_t *xc, struct manage_cookies *ck, struct manage_props *p);
+static uint32_t manage_prop_long(xcb_get_property_reply_t *r, uint32_t def);
+static bool title_from_property(char *title, size_t size, XTextProperty *tp);
+static struct title *title_intern(const char *str);
+static void title_release(struct title *t);
+static struct client *client_alloc(void);
+static void client_free(struct client *c);
+static unsigned int protocol_bit(Atom atom);
+static unsigned int client_protocols(struct client *c);
+static void client_map(struct client *c);
+static void manage_existing_windows(void);
 static int manage_xsend_icccm(struct client *c, Atom atom);
 static void grab_buttons(void);
 static void ungrab_buttons(void);
-static void refresh_config(void);
+static void refresh_config(bool rebuild);
+static void repaint_config(void);
 static void run(void);
+static void batch_flush(void);
+static bool event_coalesce(int n, XEvent *e);
 static bool safe_to_focus(int ws);
 static void setup(void);
 static void switch_ws(int ws);
+static void *ws_array_grow(void *arr, size_t elem, int n);
+static bool ws_grow(int n);
+static bool ws_set_count(int n);
+static void ws_used_add(int ws);
+static void ws_used_remove(int ws);
 static void warp_pointer(struct client *c);
 static void usage(void);
 static void version(void);
@@ -196,6 +411,12 @@ static const ipc_event_handler_t ipc_handler [IPCLast] = {
     [IPCPointerFocus]             = ipc_pointer_focus,
     [IPCSaveMonitor]              = ipc_save_monitor,
     [IPCSetFont]                  = ipc_set_font,
+    [IPCNameDesktop]              = ipc_name_desktop,
+    [IPCQuery]                    = ipc_query,
+    [IPCTrace]                    = ipc_trace,
+    [IPCStats]                    = ipc_stats,
+    [IPCSubscribe]                = ipc_subscribe,
+    [IPCConfigTransaction]        = ipc_config_transaction,
     [IPCEdgeGap]                  = ipc_edge_gap,
     [IPCConfig]                   = ipc_config
 };
@@ -211,47 +432,10 @@ euclidean_distance(const struct client *a, const struct client *b)
 static void
 client_cardinal_focus(struct client *c, int dir)
 {
-    struct client *tmp, *focus_next;
-    int min;
-
-    tmp = c_list[curr_ws];
-    focus_next = NULL;
-    min = INT_MAX;
-
-    while (tmp != NULL) {
-        int dist = euclidean_distance(c, tmp);
-        switch (dir) {
-            case EAST:
-                LOGN("Focusing EAST");
-                if (tmp->geom.x > c->geom.x && dist < min) {
-                    min = dist;
-                    focus_next = tmp;
-                }
-                break;
-            case SOUTH:
-                LOGN("Focusing SOUTH");
-                if (tmp->geom.y > c->geom.y && dist < min) {
-                    min = dist;
-                    focus_next = tmp;
-                }
-                break;
-            case WEST:
-                LOGN("Focusing WEST");
-                if (tmp->geom.x < c->geom.x && dist < min) {
-                    min = dist;
-                    focus_next = tmp;
-                }
-                break;
-            case NORTH:
-                LOGN("Focusing NORTH");
-                if (tmp->geom.y < c->geom.y && dist < min) {
-                    min = dist;
-                    focus_next = tmp;
-                }
-                break;
-        }
-        tmp = tmp->next;
-    }
+    struct client *focus_next;
+
+    LOGP("Focusing in direction %d", dir);
+    focus_next = ws_index_nearest(c, dir);
 
     if (focus_next == NULL) {
         LOGN("Cannot cardinal focus, no valid windows found");
@@ -298,11 +482,50 @@ close_wm(void)
 {
     LOGN("Shutting down window manager");
 
-    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
-        while (c_list[i] != NULL)
-            client_delete(c_list[i]);
+    /* Leave every window on screen for whoever manages them next */
+    for (int i = 0; i < ws_used_count; i++)
+        for (struct client *tmp = c_list[ws_used[i]]; tmp != NULL; tmp = tmp->next)
+            client_set_hidden(tmp, false);
+
+    /* Each workspace leaves ws_used with its last client */
+    while (ws_used_count > 0)
+        client_delete(c_list[ws_used[0]]);
+
+    batch_flush();
+    ipc_socket_close();
+    shm_status_close();
+    monitors_free();
+
+    while (client_slabs != NULL) {
+        struct client_slab *next = client_slabs->next;
+        free(client_slabs);
+        client_slabs = next;
     }
 
+    for (int i = 0; i < TITLE_BUCKETS; i++) {
+        while (title_table[i] != NULL) {
+            struct title *next = title_table[i]->next;
+            free(title_table[i]);
+            title_table[i] = next;
+        }
+    }
+    title_none = NULL;
+
+    free(c_list);
+    free(c_tail);
+    free(f_list);
+    free(f_tail);
+    free(ws_index);
+    free(p_grid);
+    free(p_rects);
+    free(ws_m_list);
+    free(ws_used);
+    free(ws_used_pos);
+
+    font_release(font_res);
+    color_release(text_focus);
+    color_release(text_unfocus);
+    res_cache_free();
 
     XDeleteProperty(display, root, net_berry[BerryWindowStatus]);
     XDeleteProperty(display, root, net_berry[BerryFontProperty]);
@@ -312,13 +535,155 @@ close_wm(void)
     XCloseDisplay(display);
 }
 
+/* Measure the title of the given client and find how many bytes of it fit
+ * across the decoration. Prefix widths only grow with length, so the cut
+ * is found by binary search. The result is cached on the client until
+ * the title, font or width change.
+ */
+static void
+title_layout(struct client *c)
+{
+    XGlyphInfo extents;
+    int lo, hi, mid, n;
+
+    if (c->t_valid && c->t_font == font && c->t_width == c->geom.width)
+        return;
+
+    n = c->title->len;
+    XftTextExtentsUtf8(display, font, (XftChar8 *)c->title->str, n, &extents);
+    c->t_ascent = extents.y;
+
+    if (extents.xOff >= c->geom.width) {
+        lo = 0;
+        hi = n - 1;
+        while (lo < hi) {
+            mid = (lo + hi + 1) / 2;
+            XftTextExtentsUtf8(display, font, (XftChar8 *)c->title->str, mid, &extents);
+            if (extents.xOff < c->geom.width)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+
+        /* Never split a multibyte UTF-8 sequence */
+        while (lo > 0 && ((unsigned char)c->title->str[lo] & 0xC0) == 0x80)
+            lo--;
+
+        n = lo;
+        XftTextExtentsUtf8(display, font, (XftChar8 *)c->title->str, n, &extents);
+    }
+
+    c->t_extents = extents;
+    c->t_len = n;
+    c->t_font = font;
+    c->t_width = c->geom.width;
+    c->t_valid = true;
+}
+
+static void
+title_pixmap_free(struct client *c)
+{
+    for (int i = 0; i < 2; i++) {
+        if (c->t_pm[i] != None)
+            XFreePixmap(display, c->t_pm[i]);
+        c->t_pm[i] = None;
+        c->t_pm_gen[i] = 0;
+    }
+    c->t_pm_cap = c->t_pm_h = 0;
+}
+
+/* Render the title bar for the given focus state into its pixmap, unless
+ * the pixmap already holds the current title at the current width.
+ * Returns the pixmap, or None if it could not be rendered.
+ */
+static Pixmap
+title_pixmap(struct client *c, bool focused)
+{
+    int w, x, y;
+
+    w = MAX(c->geom.width - 2 * conf.b_width, MINIMUM_DIM);
+
+    if (c->t_pm[focused] != None && c->t_pm_gen[focused] == title_gen && c->t_pm_w[focused] == w)
+        return c->t_pm[focused];
+
+    /* Allocate in steps so that dragging out a resize does not
+     * reallocate on every motion event */
+    if (w > c->t_pm_cap || conf.t_height != c->t_pm_h) {
+        title_pixmap_free(c);
+        c->t_pm_cap = (w + TITLE_PIXMAP_STEP - 1) / TITLE_PIXMAP_STEP * TITLE_PIXMAP_STEP;
+        c->t_pm_h = conf.t_height;
+    }
+
+    if (c->t_pm[focused] == None)
+        c->t_pm[focused] = XCreatePixmap(display, c->dec, c->t_pm_cap, c->t_pm_h,
+                DefaultDepth(display, screen));
+
+    if (c->draw == NULL)
+        c->draw = XftDrawCreate(display, c->t_pm[focused], DefaultVisual(display, screen), DefaultColormap(display, screen));
+    else
+        XftDrawChange(c->draw, c->t_pm[focused]);
+
+    LOGP("Rendering %s title pixmap", focused ? "focused" : "unfocused");
+    XSetForeground(display, gc, focused ? conf.if_color : conf.iu_color);
+    XFillRectangle(display, c->t_pm[focused], gc, 0, 0, w, c->t_pm_h);
+
+    title_layout(c);
+    if (c->t_extents.y <= conf.t_height) {
+        y = (conf.t_height / 2) + (c->t_ascent / 2);
+        x = !conf.t_center ? TITLE_X_OFFSET : (c->geom.width - c->t_extents.width) / 2;
+        XftDrawStringUtf8(c->draw, focused ? &text_focus->color : &text_unfocus->color, font,
+                x, y, (XftChar8 *) c->title->str, c->t_len);
+    } else {
+        LOGN("Text is taller than title bar height, not drawing text");
+    }
+
+    c->t_pm_gen[focused] = title_gen;
+    c->t_pm_w[focused] = w;
+    return c->t_pm[focused];
+}
+
+/* Repaint the part of the title bar of the given client that falls
+ * inside the given rectangle. In pixmap mode this is a single copy
+ * from the pre-rendered title, otherwise the whole title is redrawn.
+ */
+static void
+draw_text_area(struct client *c, bool focused, int x, int y, int w, int h)
+{
+    Pixmap pm;
+
+    if (!conf.t_pixmap) {
+        draw_text(c, focused);
+        return;
+    }
+
+    if (!conf.draw_text || !c->decorated)
+        return;
+
+    pm = title_pixmap(c, focused);
+    if (pm == None)
+        return;
+
+    /* Clip the damage to the rendered title */
+    w = MIN(x + w, c->t_pm_w[focused]) - MAX(x, 0);
+    h = MIN(y + h, c->t_pm_h) - MAX(y, 0);
+    x = MAX(x, 0);
+    y = MAX(y, 0);
+    if (w <= 0 || h <= 0)
+        return;
+
+    XCopyArea(display, pm, c->dec, gc, x, y, w, h, x, y);
+}
+
 static void
 draw_text(struct client *c, bool focused)
 {
-    XftDraw *draw;
     XftColor *xft_render_color;
-    XGlyphInfo extents;
-    int x, y, len;
+    int x, y;
+
+    if (conf.t_pixmap) {
+        draw_text_area(c, focused, 0, 0, c->geom.width, conf.t_height);
+        return;
+    }
 
     if (!conf.draw_text) {
         LOGN("drawing text disabled");
@@ -330,31 +695,27 @@ draw_text(struct client *c, bool focused)
         return;
     }
 
-    XftTextExtentsUtf8(display, font, (XftChar8 *)c->title, strlen(c->title), &extents);
-    y = (conf.t_height / 2) + ((extents.y) / 2);
-    x = !conf.t_center ? TITLE_X_OFFSET : (c->geom.width - extents.width) / 2;
-
-    for (len = strlen(c->title); len >= 0; len--) {
-        XftTextExtentsUtf8(display, font, (XftChar8 *)c->title, len, &extents);
-        if (extents.xOff < c->geom.width)
-            break;
-    }
+    title_layout(c);
+    y = (conf.t_height / 2) + (c->t_ascent / 2);
+    x = !conf.t_center ? TITLE_X_OFFSET : (c->geom.width - c->t_extents.width) / 2;
 
-    LOGP("Text height is %u", extents.height);
+    LOGP("Text height is %u", c->t_extents.height);
 
-    if (extents.y > conf.t_height) {
+    if (c->t_extents.y > conf.t_height) {
         LOGN("Text is taller than title bar height, not drawing text");
         return;
     }
 
     LOGN("Drawing text on client");
     LOGN("Drawing the following text");
-    LOGP("   %s", c->title);
+    LOGP("   %s", c->title->str);
     XClearWindow(display, c->dec);
-    draw = XftDrawCreate(display, c->dec, DefaultVisual(display, screen), DefaultColormap(display, screen));
-    xft_render_color = focused ? &xft_focus_color : &xft_unfocus_color;
-    XftDrawStringUtf8(draw, xft_render_color, font, x, y, (XftChar8 *) c->title, strlen(c->title));
-    XftDrawDestroy(draw);
+    if (c->draw == NULL)
+        c->draw = XftDrawCreate(display, c->dec, DefaultVisual(display, screen), DefaultColormap(display, screen));
+    else if (XftDrawDrawable(c->draw) != c->dec)
+        XftDrawChange(c->draw, c->dec);
+    xft_render_color = focused ? &text_focus->color : &text_unfocus->color;
+    XftDrawStringUtf8(c->draw, xft_render_color, font, x, y, (XftChar8 *) c->title->str, c->t_len);
 }
 
 /* Communicate with the given Client, kindly telling it to close itself
@@ -388,8 +749,23 @@ client_decorations_create(struct client *c)
             conf.bu_color, conf.bf_color);
 
     c->dec = dec;
+    c->d_sent.width = 0;
     c->decorated = true;
-    XSelectInput (display, c->dec, ExposureMask|EnterWindowMask);
+    c->framed = conf.reparent;
+    c->draw = XftDrawCreate(display, c->dec, DefaultVisual(display, screen), DefaultColormap(display, screen));
+    win_index_insert(c->dec, c);
+
+    if (c->framed) {
+        /* The window's requests now go through its frame rather than root */
+        XSelectInput(display, c->dec, ExposureMask|EnterWindowMask|SubstructureRedirectMask);
+        XAddToSaveSet(display, c->window);
+        XReparentWindow(display, c->window, c->dec, conf.i_width, conf.i_width + conf.t_height);
+        c->w_sent.width = 0;
+        if (c->mapped)
+            c->ignore_unmap++;
+    } else {
+        XSelectInput(display, c->dec, ExposureMask|EnterWindowMask);
+    }
     XGrabButton(display, 1, AnyModifier, c->dec, True, ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
     draw_text(c, true);
     ewmh_set_frame_extents(c);
@@ -402,6 +778,25 @@ client_decorations_destroy(struct client *c)
 {
     LOGN("Removing decorations");
     c->decorated = false;
+    win_index_remove(c->dec, c);
+    if (c->draw != NULL) {
+        XftDrawDestroy(c->draw);
+        c->draw = NULL;
+    }
+    title_pixmap_free(c);
+
+    if (c->framed) {
+        /* Put the window back where it appears before its frame goes */
+        XReparentWindow(display, c->window, root,
+                c->geom.x + conf.i_width + conf.b_width,
+                c->geom.y + conf.i_width + conf.b_width + conf.t_height);
+        XRemoveFromSaveSet(display, c->window);
+        c->framed = false;
+        c->w_sent.width = 0;
+        if (c->mapped)
+            c->ignore_unmap++;
+    }
+
     XUnmapWindow(display, c->dec);
     XDestroyWindow(display, c->dec);
     ewmh_set_frame_extents(c);
@@ -427,36 +822,26 @@ client_delete(struct client *c)
     /* Prevent BadDrawable error which sometimes occurs as a window is closed */
     client_decorations_destroy(c);
 
-    /* Delete in the stack */
-    if (c_list[ws] == c) {
-        c_list[ws] = c_list[ws]->next;
-    } else {
-        struct client *tmp = c_list[ws];
-        while (tmp != NULL && tmp->next != c)
-            tmp = tmp->next;
-
-        if (tmp)
-            tmp->next = tmp->next->next;
-    }
-
-    /* Delete in the focus list */
-    /* I'll factor this out later */
-    /* Or actually it might not be so easy... */
-    if (f_list[ws] == c) {
-        f_list[ws] = f_list[ws]->f_next;
-    } else {
-        struct client *tmp = f_list[ws];
-        while (tmp != NULL && tmp->f_next != c)
-            tmp = tmp->f_next;
-
-        if (tmp)
-            tmp->f_next = tmp->f_next->f_next;
-    }
+    stack_unlink(c);
+    focus_unlink(c);
+    if (focus_pending == c)
+        focus_pending = NULL;
 
-    if (c_list[ws] == NULL)
+    if (c_list[ws] == NULL) {
         f_client = NULL;
-
+        ws_used_remove(ws);
+    }
+    WS_LISTS_CHECK(ws);
+
+    win_index_remove(c->window, c);
+    ws_index_remove(c);
+    place_grid_forget(c);
+    place_rects_dirty(c->ws);
+    if (p_rects[c->ws].skip == c)
+        p_rects[c->ws].skip = NULL;
+    client_list_remove(c->window);
     ewmh_set_client_list();
+    status_forget(c);
 }
 
 static void
@@ -557,28 +942,126 @@ focus_best(struct client *c)
     if (c == NULL)
         return;
 
-    if (c_list[c->ws]->next == NULL)
-        return;
-    else
-        client_manage_focus(c_list[c->ws]->next);
+    /* The topmost client other than c */
+    struct client *best = c_list[c->ws] == c ? c->next : c_list[c->ws];
+    if (best != NULL)
+        client_manage_focus(best);
 }
 
 /* Returns the struct client associated with the given struct Window */
 static struct client*
 get_client_from_window(Window w)
 {
-    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
-        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
-            if (tmp->window == w)
-                return tmp;
-            else if (tmp->decorated && tmp->dec == w)
-                return tmp;
+    return win_index_lookup(w);
+}
+
+/* XIDs are handed out sequentially per X connection, so mix the bits
+ * before masking to keep neighbouring windows from sharing a slot run
+ */
+static unsigned int
+win_index_slot(Window w)
+{
+    uint64_t h = (uint64_t)w * 0x9E3779B97F4A7C15ull;
+    return (unsigned int)(h >> 32) & (w_index_size - 1);
+}
+
+static void
+win_index_grow(void)
+{
+    struct win_entry *old = w_index;
+    unsigned int old_size = w_index_size;
+
+    w_index_size = old_size == 0 ? WIN_INDEX_INITIAL : old_size * 2;
+    w_index = calloc(w_index_size, sizeof(struct win_entry));
+    if (w_index == NULL) {
+        LOGN("Error, could not grow window index");
+        w_index = old;
+        w_index_size = old_size;
+        return;
+    }
+
+    LOGP("Growing window index to %u slots", w_index_size);
+    w_index_count = 0;
+    for (unsigned int i = 0; i < old_size; i++)
+        if (old[i].window != None)
+            win_index_insert(old[i].window, old[i].c);
+    free(old);
+}
+
+static void
+win_index_insert(Window w, struct client *c)
+{
+    unsigned int i;
+
+    if (w == None)
+        return;
+
+    /* Keep the load factor at or below one half */
+    if (2 * (w_index_count + 1) > w_index_size) {
+        win_index_grow();
+        if (2 * (w_index_count + 1) > w_index_size)
+            return;
+    }
+
+    for (i = win_index_slot(w); w_index[i].window != None; i = (i + 1) & (w_index_size - 1)) {
+        if (w_index[i].window == w) {
+            w_index[i].c = c;
+            return;
         }
     }
 
+    w_index[i].window = w;
+    w_index[i].c = c;
+    w_index_count++;
+}
+
+static struct client*
+win_index_lookup(Window w)
+{
+    if (w == None || w_index_count == 0)
+        return NULL;
+
+    for (unsigned int i = win_index_slot(w); w_index[i].window != None; i = (i + 1) & (w_index_size - 1))
+        if (w_index[i].window == w)
+            return w_index[i].c;
+
     return NULL;
 }
 
+/* Remove the given window from the index, but only if it still refers to
+ * the given client. Uses backward shift deletion so that lookups never
+ * need tombstones.
+ */
+static void
+win_index_remove(Window w, struct client *c)
+{
+    unsigned int i, j, k, mask;
+
+    if (w == None || w_index_count == 0)
+        return;
+
+    mask = w_index_size - 1;
+    for (i = win_index_slot(w); w_index[i].window != w; i = (i + 1) & mask)
+        if (w_index[i].window == None)
+            return;
+
+    if (w_index[i].c != c)
+        return;
+
+    for (j = (i + 1) & mask; w_index[j].window != None; j = (j + 1) & mask) {
+        k = win_index_slot(w_index[j].window);
+        /* Move the entry back if its home slot does not lie in (i, j] */
+        if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j)) {
+            w_index[i] = w_index[j];
+            i = j;
+        }
+    }
+
+    w_index[i].window = None;
+    w_index[i].c = NULL;
+    w_index_count--;
+}
+
 /* Redirect an XEvent from berry's client program, berryc */
 static void
 handle_client_message(XEvent *e)
@@ -594,7 +1077,15 @@ handle_client_message(XEvent *e)
 		}
         cmd = cme->data.l[0];
         data = cme->data.l;
-        ipc_handler[cmd](data);
+        LOGP("Dispatching command %ld", cmd);
+        /* A client message has nowhere to send output, drop it */
+        ipc_out.len = 0;
+        ipc_status = IPCStatusOk;
+        ipc_dispatch(data);
+        ipc_out.len = 0;
+    } else if (cme->message_type == net_berry[BerryClientBatch]) {
+        LOGP("Recieved batch of %ld commands from berryc", cme->data.l[0]);
+        ipc_apply_batch();
     } else if (cme->message_type == net_atom[NetWMState]) {
         struct client* c = get_client_from_window(cme->window);
         if (c == NULL) {
@@ -628,6 +1119,9 @@ handle_client_message(XEvent *e)
     } else if (cme->message_type == net_atom[NetCurrentDesktop]) {
         switch_ws(cme->data.l[0]);
 
+    } else if (cme->message_type == net_atom[NetNumberOfDesktops]) {
+        ws_set_count(cme->data.l[0]);
+
     } else if (cme->message_type == net_atom[NetWMMoveResize]) {
         LOGN("Handling MOVERESIZE");
         struct client *c = get_client_from_window(cme->window);
@@ -646,14 +1140,17 @@ handle_button_press(XEvent *e)
      * this function.
      */
     XButtonPressedEvent *bev = &e->xbutton;
-    XEvent ev;
+    XEvent ev, motion;
     struct client *c;
-    int x, y, ocx, ocy, nx, ny, nw, nh, di, ocw, och;
+    struct drag d;
+    int di;
     unsigned int dui;
+    bool pending = false;
+    uint64_t motion_due = 0, due, now;
     Window dummy;
     Time current_time, last_motion;
 
-    XQueryPointer(display, root, &dummy, &dummy, &x, &y, &di, &di, &dui);
+    XQueryPointer(display, root, &dummy, &dummy, &d.x, &d.y, &di, &di, &dui);
     LOGN("Handling button press event");
     c = get_client_from_window(bev->window);
     if (c == NULL)
@@ -662,15 +1159,54 @@ handle_button_press(XEvent *e)
         switch_ws(c->ws);
         client_manage_focus(c);
     }
-    ocx = c->geom.x;
-    ocy = c->geom.y;
-    ocw = c->geom.width;
-    och = c->geom.height;
-    last_motion = ev.xmotion.time;
+    d.orig = d.outline = c->geom;
+    last_motion = 0;
     if (XGrabPointer(display, root, False, MOUSEMASK, GrabModeAsync, GrabModeAsync, None, move_cursor, CurrentTime) != GrabSuccess)
         return;
+
+    /* Nobody else may draw while the outline is up, or it would be
+     * left behind in their windows when erased */
+    if (conf.drag_mode == DragOutline) {
+        XGrabServer(display);
+        drag_outline(&d.outline);
+    }
+
+    d.has_deferred = false;
     do {
-        XMaskEvent(display, MOUSEMASK|ExposureMask|SubstructureRedirectMask, &ev);
+        if (!pending && !d.has_deferred) {
+            XIfEvent(display, &ev, drag_event, NULL);
+        } else if (!XCheckIfEvent(display, &ev, drag_event, NULL)) {
+            /* Hold the newest motion until its frame comes up, or a deferred
+             * resize until the client has had its chance to catch up. Other
+             * events waking us up must not push either back. */
+            due = pending ? motion_due : d.deferred_due;
+            now = now_usec();
+            if (now < due && drag_wait((int)((due - now + 999) / 1000)))
+                continue;
+            if (pending) {
+                drag_motion(c, &d, &motion.xmotion);
+                last_motion = motion.xmotion.time;
+                pending = false;
+            } else {
+                LOGN("Client did not answer sync request in time");
+                c->sync_wait = false;
+                d.has_deferred = false;
+                drag_motion(c, &d, &d.deferred);
+            }
+            continue;
+        }
+
+        if (ev.type >= LASTEvent) {
+            /* The client has drawn the last size, send the newest one */
+            if (!client_sync_alarm(c, &ev)) {
+                handle_extension_event(&ev);
+            } else if (d.has_deferred && !c->sync_wait) {
+                d.has_deferred = false;
+                drag_motion(c, &d, &d.deferred);
+            }
+            continue;
+        }
+
         switch (ev.type) {
             case ConfigureRequest:
             case Expose:
@@ -678,32 +1214,143 @@ handle_button_press(XEvent *e)
                 event_handler[ev.type](&ev);
                 break;
             case MotionNotify:
+                if (conf.drag_mode == DragInterval) {
+                    current_time = ev.xmotion.time;
+                    Time diff_time = current_time - last_motion;
+                    if (diff_time < (Time)conf.pointer_interval) {
+                        continue;
+                    }
+                    last_motion = current_time;
+                    drag_motion(c, &d, &ev.xmotion);
+                    break;
+                }
+
+                /* Only the newest position matters */
+                while (XCheckMaskEvent(display, PointerMotionMask, &ev))
+                    ;
                 current_time = ev.xmotion.time;
-                Time diff_time = current_time - last_motion;
-                if (diff_time < (Time)conf.pointer_interval) {
-                    continue;
+                if (current_time - last_motion >= (Time)frame_ms) {
+                    drag_motion(c, &d, &ev.xmotion);
+                    last_motion = current_time;
+                    pending = false;
+                } else {
+                    motion = ev;
+                    motion_due = now_usec() + (uint64_t)(frame_ms - (current_time - last_motion)) * 1000;
+                    pending = true;
                 }
-                last_motion = current_time;
-                if (ev.xbutton.state == (unsigned)(conf.move_mask|Button1Mask) || ev.xbutton.state == Button1Mask) {
-                    nx = ocx + (ev.xmotion.x - x);
-                    ny = ocy + (ev.xmotion.y - y);
-                    if (conf.edge_lock)
-                        client_move_relative(c, nx - c->geom.x, ny - c->geom.y);
-                    else
-                        client_move_absolute(c, nx, ny);
-                } else if (ev.xbutton.state == (unsigned)(conf.resize_mask|Button1Mask)) {
-                    nw = ev.xmotion.x - x;
-                    nh = ev.xmotion.y - y;
-                    if (conf.edge_lock)
-                        client_resize_relative(c, nw - c->geom.width + ocw, nh - c->geom.height + och);
-                    else
-                        client_resize_absolute(c, ocw + nw, och + nh);
+                break;
+            case ButtonRelease:
+                if (pending)
+                    drag_motion(c, &d, &motion.xmotion);
+                if (d.has_deferred) {
+                    c->sync_wait = false;
+                    drag_motion(c, &d, &d.deferred);
                 }
-                XFlush(display);
                 break;
         }
     } while (ev.type != ButtonRelease);
+
+    if (conf.drag_mode == DragOutline) {
+        drag_outline(&d.outline);
+        XUngrabServer(display);
+        client_move_absolute(c, d.outline.x, d.outline.y);
+        client_resize_absolute(c, d.outline.width, d.outline.height);
+    }
     XUngrabPointer(display, CurrentTime);
+    status_flush();
+}
+
+/* Move or resize the dragged client to follow the given pointer motion.
+ * In DragOutline only the outline follows.
+ */
+static void
+drag_motion(struct client *c, struct drag *d, XMotionEvent *m)
+{
+    struct client_geom g = conf.drag_mode == DragOutline ? d->outline : c->geom;
+    int nx, ny, nw, nh;
+
+    if (m->state == (unsigned)(conf.move_mask|Button1Mask) || m->state == Button1Mask) {
+        nx = d->orig.x + (m->x - d->x);
+        ny = d->orig.y + (m->y - d->y);
+        if (conf.edge_lock) {
+            client_lock_move(c, &g, nx - g.x, ny - g.y);
+        } else {
+            g.x = nx;
+            g.y = ny;
+        }
+    } else if (m->state == (unsigned)(conf.resize_mask|Button1Mask)) {
+        /* Don't pile up sizes the client is still busy drawing */
+        if (conf.drag_mode != DragOutline && c->sync_wait && m->time - c->sync_time < SYNC_TIMEOUT) {
+            if (!d->has_deferred)
+                d->deferred_due = now_usec() + (uint64_t)SYNC_TIMEOUT * 1000;
+            d->deferred = *m;
+            d->has_deferred = true;
+            return;
+        }
+
+        nw = m->x - d->x;
+        nh = m->y - d->y;
+        if (conf.edge_lock) {
+            client_lock_resize(c, &g, nw - g.width + d->orig.width, nh - g.height + d->orig.height);
+        } else {
+            g.width = MAX(d->orig.width + nw, MINIMUM_DIM);
+            g.height = MAX(d->orig.height + nh, MINIMUM_DIM);
+        }
+    } else {
+        return;
+    }
+
+    if (conf.drag_mode == DragOutline) {
+        drag_outline(&d->outline);
+        d->outline = g;
+        drag_outline(&d->outline);
+    } else {
+        /* Only a new size is answered by the client bumping its counter */
+        bool resized = g.width != c->geom.width || g.height != c->geom.height;
+        client_move_absolute(c, g.x, g.y);
+        if (resized) {
+            client_sync_request(c, m->time);
+            client_resize_absolute(c, g.width, g.height);
+        }
+    }
+    XFlush(display);
+}
+
+/* Events the drag loop handles itself, everything else stays queued */
+static Bool
+drag_event(Display *d, XEvent *e, XPointer arg)
+{
+    UNUSED(d);
+    UNUSED(arg);
+
+    switch (e->type) {
+        case ButtonPress:
+        case ButtonRelease:
+        case MotionNotify:
+        case Expose:
+        case ConfigureRequest:
+        case MapRequest:
+        case CirculateRequest:
+            return True;
+        default:
+            return sync_supported && e->type == sync_event_base + XSyncAlarmNotify;
+    }
+}
+
+/* Drawing the outline a second time erases it */
+static void
+drag_outline(struct client_geom *g)
+{
+    XDrawRectangle(display, root, outline_gc, g->x, g->y, g->width, g->height);
+}
+
+/* Wait up to ms for the X server to send something, returns true if it did */
+static bool
+drag_wait(int ms)
+{
+    struct pollfd fd = { .fd = ConnectionNumber(display), .events = POLLIN };
+
+    return poll(&fd, 1, MAX(ms, 0)) > 0;
 }
 
 static void
@@ -720,7 +1367,7 @@ handle_expose(XEvent *e)
         return;
     }
     focused = c == f_client;
-    draw_text(c, focused);
+    draw_text_area(c, focused, ev->x, ev->y, ev->width, ev->height);
 }
 
 static void
@@ -743,6 +1390,11 @@ handle_property_notify(XEvent *e)
     if (c == NULL)
         return;
 
+    if (ev->atom == wm_atom[WMProtocols]) {
+        c->p_valid = false;
+        return;
+    }
+
     if (ev->state == PropertyDelete)
         return;
 
@@ -758,17 +1410,19 @@ handle_configure_notify(XEvent *e)
 {
     XConfigureEvent *ev = &e->xconfigure;
 
-    if (ev->window == root) {
-        // handle display size changes by the root window
-        display_width = ev->width;
-        display_height = ev->height;
-    }
+    /* Root is told about every one of its children being configured */
+    if (ev->window != root)
+        return;
 
+    // handle display size changes by the root window
+    display_width = ev->width;
+    display_height = ev->height;
 
     LOGN("Handling configure notify event");
 
-    monitors_free();
-    monitors_setup();
+    /* With XRandR its own events say when monitors changed */
+    if (!randr_supported)
+        monitors_setup();
 }
 
 static void
@@ -788,10 +1442,42 @@ handle_configure_request(XEvent *e)
     wc.border_width = ev->border_width;
     wc.sibling = ev->above;
     wc.stack_mode = ev->detail;
-    XConfigureWindow(display, ev->window, ev->value_mask, &wc);
     c = get_client_from_window(ev->window);
 
+    /* A framed window is never configured directly, its frame is fitted
+     * around what it asks for instead. Per ICCCM 4.1.5 x and y are where
+     * the client wants its own top left corner on root, and only the
+     * fields in value_mask are asked for. */
+    if (c != NULL && c->framed && ev->window == c->window) {
+        if (!c->fullscreen) {
+            int x = c->geom.x, y = c->geom.y, w = c->geom.width, h = c->geom.height;
+
+            if (ev->value_mask & CWX)
+                x = ev->x - left_width(c);
+            if (ev->value_mask & CWY)
+                y = ev->y - top_height(c);
+            if (ev->value_mask & CWWidth)
+                w = ev->width + get_dec_width(c);
+            if (ev->value_mask & CWHeight)
+                h = ev->height + get_dec_height(c);
+
+            if (x != c->geom.x || y != c->geom.y)
+                client_move_absolute(c, x, y);
+            if (w != c->geom.width || h != c->geom.height)
+                client_resize_absolute(c, w, h);
+            client_refresh(c);
+        }
+        /* Tell the client where it ended up, whether or not it moved */
+        client_send_configure(c);
+        return;
+    }
+
+    XConfigureWindow(display, ev->window, ev->value_mask, &wc);
+
     if (c != NULL) {
+        /* The window no longer has the geometry we last gave it */
+        if (ev->window == c->window)
+            c->w_sent.width = 0;
         if (c->fullscreen)
             return;
 
@@ -831,12 +1517,27 @@ handle_unmap_notify(XEvent *e)
     c = get_client_from_window(ev->window);
 
     if (c != NULL) {
+        /* Each unmap is also reported to the parent, only count the
+         * window's own copy so framed and unframed clients agree */
+        if (ev->event != ev->window && !ev->send_event)
+            return;
+        if (c->ignore_unmap > 0 && !ev->send_event) {
+            LOGN("Ignoring unmap caused by reparenting");
+            c->ignore_unmap--;
+            return;
+        }
+
         LOGN("Client found while unmapping, focusing next client");
         focus_best(c);
-        if (c->decorated)
+        /* The window is unmapped already, so when client_delete takes it
+         * out of its frame no UnmapNotify follows to be ignored */
+        c->mapped = false;
+        if (c->decorated && !c->framed)
             XDestroyWindow(display, c->dec);
+        ipc_event_window(IPCEventUnmap, c);
         client_delete(c);
-        free(c);
+        client_sync_free(c);
+        client_free(c);
         client_raise(f_client);
     } else {
         /* Some applications *ahem* Spotify *ahem*, don't seem to place nicely with being deleted.
@@ -863,74 +1564,168 @@ handle_enter_notify(XEvent *e)
     if (!conf.follow_pointer)
         return;
 
+    /* The window only came under the pointer because we moved it */
+    if (ev->serial < enter_serial)
+        return;
+
     c = get_client_from_window(ev->window);
+    if (c == NULL)
+        return;
 
-    if (c != NULL && c != f_client) {
-        bool warp_pointer;
-        warp_pointer = conf.warp_pointer;
-        conf.warp_pointer = false;
-        client_manage_focus(c);
-        if (c->ws != curr_ws)
-            switch_ws(c->ws);
-        conf.warp_pointer = warp_pointer;
+    if (c == f_client) {
+        /* Back on the focused window before the delay ran out */
+        focus_pending = NULL;
+        return;
     }
-}
 
-/* Hides the given Client by moving it outside of the visible display */
-static void
-client_hide(struct client *c)
-{
-    if (!c->hidden) {
-        c->x_hide = c->geom.x;
-        LOGN("Hiding client");
-        client_move_absolute(c, display_width + conf.b_width, c->geom.y);
-        c->hidden = true;
-    }
+    /* Only the last window entered gets focus, once the pointer settles */
+    focus_pending = c;
+    focus_due = now_usec() + (uint64_t)MAX(conf.focus_delay, 0) * 1000;
+    if (conf.focus_delay <= 0)
+        focus_pending_commit();
 }
 
+/* Focus the client the pointer entered last, once it has stayed there
+ * for conf.focus_delay. Called from batch_flush and after ipc_wait
+ * woke up for focus_pending_timeout. */
 static void
-ipc_move_absolute(long *d)
+focus_pending_commit(void)
 {
-    int x, y;
+    struct client *c = focus_pending;
+    bool warp_pointer;
 
-    if (f_client == NULL)
+    if (c == NULL || now_usec() < focus_due)
         return;
 
-    x = d[1];
-    y = d[2];
+    focus_pending = NULL;
+    /* Another monitor's workspace is fine, client_manage_focus switches
+     * to it, but not a window that went off screen meanwhile */
+    if (c == f_client || c->hidden)
+        return;
 
-    client_move_absolute(f_client, x, y);
+    warp_pointer = conf.warp_pointer;
+    conf.warp_pointer = false;
+    client_manage_focus(c);
+    conf.warp_pointer = warp_pointer;
 }
 
-static void
-ipc_move_relative(long *d)
+/* Milliseconds until focus_pending is due, -1 if there is none */
+static int
+focus_pending_timeout(void)
 {
-    int x, y;
-
-    if (f_client == NULL)
-        return;
+    uint64_t now;
 
-    x = d[1];
-    y = d[2];
+    if (focus_pending == NULL)
+        return -1;
 
-    client_move_relative(f_client, x, y);
+    now = now_usec();
+    return now >= focus_due ? 0 : (int)((focus_due - now + 999) / 1000);
 }
 
+/* Hides the given Client by moving it outside of the visible display */
 static void
-ipc_monocle(long *d)
+client_hide(struct client *c)
 {
-    UNUSED(d);
-    if (f_client == NULL)
-        return;
-
-    client_monocle(f_client);
+    client_set_hidden(c, true);
 }
 
+/* Move the client off or back on to the display, without restacking */
 static void
-ipc_raise(long *d)
+client_set_hidden(struct client *c, bool hidden)
 {
-    UNUSED(d);
-    if (f_client == NULL)
+    if (c->hidden == hidden)
+        return;
+
+    if (hidden) {
+        c->x_hide = c->geom.x;
+        LOGN("Hiding client");
+        client_move_absolute(c, display_width + conf.b_width, c->geom.y);
+    } else {
+        LOGN("Showing client");
+        client_move_absolute(c, c->x_hide, c->geom.y);
+    }
+    c->hidden = hidden;
+}
+
+/* Stack the workspace's windows in c_list order with a single request */
+static void
+ws_restack(int ws)
+{
+    int n = 0;
+
+    for (struct client *tmp = c_list[ws]; tmp != NULL; tmp = tmp->next) {
+        if (n + 2 > restack_size) {
+            int size = restack_size == 0 ? WIN_INDEX_INITIAL : restack_size * 2;
+            Window *wins = realloc(restack_wins, size * sizeof(Window));
+            if (wins == NULL)
+                return;
+            restack_wins = wins;
+            restack_size = size;
+        }
+        /* A framed window is stacked inside of its frame */
+        if (!tmp->framed)
+            restack_wins[n++] = tmp->window;
+        if (tmp->decorated)
+            restack_wins[n++] = tmp->dec;
+    }
+
+    if (n > 0)
+        XRestackWindows(display, restack_wins, n);
+}
+
+/* Crossing events up to the next request come from windows we moved,
+ * only those after it are the pointer's doing
+ */
+static void
+ignore_enter_events(void)
+{
+    enter_serial = NextRequest(display);
+    XNoOp(display);
+}
+
+static void
+ipc_move_absolute(long *d)
+{
+    int x, y;
+
+    if (f_client == NULL)
+        return;
+
+    x = d[1];
+    y = d[2];
+
+    client_move_absolute(f_client, x, y);
+}
+
+static void
+ipc_move_relative(long *d)
+{
+    int x, y;
+
+    if (f_client == NULL)
+        return;
+
+    x = d[1];
+    y = d[2];
+
+    client_move_relative(f_client, x, y);
+}
+
+static void
+ipc_monocle(long *d)
+{
+    UNUSED(d);
+    if (f_client == NULL)
+        return;
+
+    client_monocle(f_client);
+}
+
+static void
+ipc_raise(long *d)
+{
+    UNUSED(d);
+    if (f_client == NULL)
         return;
 
     client_raise(f_client);
@@ -1108,15 +1903,19 @@ ipc_config(long *d)
             break;
         case IPCInnerFocusColor:
             conf.if_color = d[2];
+            title_gen++;
             break;
         case IPCInnerUnfocusColor:
             conf.iu_color = d[2];
+            title_gen++;
             break;
         case IPCTitleFocusColor:
-            load_color(&xft_focus_color, d[2]);
+            if (load_color(&text_focus, d[2]))
+                title_gen++;
             break;
         case IPCTitleUnfocusColor:
-            load_color(&xft_unfocus_color, d[2]);
+            if (load_color(&text_unfocus, d[2]))
+                title_gen++;
             break;
         case IPCBorderWidth:
             conf.b_width = d[2];
@@ -1136,52 +1935,86 @@ ipc_config(long *d)
             break;
         case IPCEdgeLock:
             conf.edge_lock = d[2];
-            break;
+            return;
         case IPCJSONStatus:
             conf.json_status = d[2];
             break;
         case IPCManage:
             conf.manage[(int)d[2]] = true;
-            break;
+            return;
         case IPCFullscreenRemoveDec:
             conf.fs_remove_dec = d[2];
             break;
         case IPCUnmanage:
             conf.manage[(int)d[2]] = false;
-            break;
+            return;
         case IPCQuit:
             running = false;
-            break;
+            return;
         case IPCDecorate:
             conf.decorate = d[2];
             break;
         case IPCDrawText:
             conf.draw_text = d[2];
             break;
+        case IPCSmartPlace:
+            if (d[2] >= 0 && d[2] < PlaceLast)
+                conf.smart_place = d[2];
+            else
+                ipc_status = IPCStatusError;
+            return;
         case IPCMoveMask:
             ungrab_buttons();
             conf.move_mask = (d[2] == 0) ? conf.move_mask : d[2];
             grab_buttons();
-            break;
+            return;
         case IPCResizeMask:
             ungrab_buttons();
             conf.resize_mask = (d[2] == 0) ? conf.resize_mask : d[2];
             grab_buttons();
-            break;
+            return;
         case IPCPointerInterval:
             conf.pointer_interval = d[2];
-            break;
+            return;
+        case IPCDragMode:
+            if (d[2] >= 0 && d[2] < DragLast)
+                conf.drag_mode = d[2];
+            else
+                ipc_status = IPCStatusError;
+            return;
         case IPCFocusFollowsPointer:
             conf.follow_pointer = d[2];
-            break;
+            focus_pending = NULL;
+            return;
+        case IPCFocusDelay:
+            conf.focus_delay = d[2];
+            return;
+        case IPCShmStatus:
+            if (!d[2])
+                shm_status_close();
+            else if (!shm_status_open())
+                ipc_status = IPCStatusError;
+            conf.shm_status = shm_status != NULL;
+            return;
         case IPCWarpPointer:
             conf.warp_pointer = d[2];
+            return;
+        case IPCTitlePixmap:
+            conf.t_pixmap = d[2];
+            break;
+        case IPCReparent:
+            /* config_apply rebuilds the decorations in the new mode */
+            conf.reparent = d[2];
             break;
+        case IPCWorkspaceCount:
+            if (!ws_set_count(d[2]))
+                ipc_status = IPCStatusError;
+            return;
         default:
             break;
     }
 
-    refresh_config();
+    config_stage();
 }
 
 static void
@@ -1200,7 +2033,166 @@ ipc_edge_gap(long *d)
 
     LOGN("Changing edge gap...");
 
-    refresh_config();
+    config_stage();
+}
+
+/* Run a single berryc command, ignoring anything we have no handler for */
+static void
+ipc_dispatch(long *d)
+{
+    if (d[0] < 0 || d[0] >= IPCLast || ipc_handler[d[0]] == NULL) {
+        LOGP("Ignoring unknown command %ld", d[0]);
+        ipc_status = IPCStatusUnknown;
+        return;
+    }
+
+    uint64_t start = now_usec();
+    unsigned long request = NextRequest(display);
+    ipc_handler[d[0]](d);
+    stats_add(&stats_ipc[d[0] == IPCConfig && d[1] >= 0 && d[1] < IPCLast ? d[1] : d[0]], start, request);
+}
+
+/* Apply every command record queued on BERRY_CLIENT_BATCH, in order.
+ * berryc appends to the property so that concurrent batches are never
+ * lost; reading it with delete set consumes all of them at once. Config
+ * changes are applied together at the end.
+ */
+static void
+ipc_apply_batch(void)
+{
+    Atom da;
+    int format;
+    unsigned long n, after;
+    unsigned char *prop_ret = NULL;
+    long *records;
+
+    if (XGetWindowProperty(display, root, net_berry[BerryClientBatch], 0, IPC_BATCH_MAX_LONGS,
+                True, XA_CARDINAL, &da, &format, &n, &after, &prop_ret) != Success || prop_ret == NULL) {
+        LOGN("Could not read command batch");
+        return;
+    }
+
+    if (format != 32) {
+        LOGN("Wrong format, ignoring batch");
+        XFree(prop_ret);
+        return;
+    }
+
+    records = (long *)prop_ret;
+    for (unsigned long i = 0; i + IPC_RECORD_LEN <= n && running; i += IPC_RECORD_LEN) {
+        ipc_out.len = 0;
+        ipc_status = IPCStatusOk;
+        ipc_dispatch(&records[i]);
+    }
+    ipc_out.len = 0;
+    ipc_batch_end();
+    XFree(prop_ret);
+}
+
+/* A batch is all the config changes there are going to be for now, so
+ * they need not wait out CONFIG_COALESCE. batch_flush applies them. */
+static void
+ipc_batch_end(void)
+{
+    if (config_staged && !config_txn)
+        config_due = now_usec();
+}
+
+/* berryc config begin holds back config changes until config commit,
+ * however many commands and connections they come in */
+static void
+ipc_config_transaction(long *d)
+{
+    switch (d[1]) {
+        case 1:
+            LOGN("Beginning config transaction");
+            config_txn = true;
+            if (config_staged)
+                config_due = now_usec() + (uint64_t)CONFIG_TXN_TIMEOUT * 1000;
+            break;
+        case 0:
+            if (!config_txn) {
+                ipc_status = IPCStatusError;
+                return;
+            }
+            LOGN("Committing config transaction");
+            config_txn = false;
+            if (config_staged)
+                config_apply();
+            break;
+        default:
+            ipc_status = IPCStatusError;
+            break;
+    }
+}
+
+/* Config commands only change conf; the clients catch up in config_apply
+ * once no more changes came for CONFIG_COALESCE, or on commit. */
+static void
+config_stage(void)
+{
+    if (config_staged)
+        return;
+
+    config_staged = true;
+    config_due = now_usec() + (uint64_t)(config_txn ? CONFIG_TXN_TIMEOUT : CONFIG_COALESCE) * 1000;
+}
+
+/* Bring the clients in line with conf, redoing only what the settings
+ * that differ from conf_applied need */
+static void
+config_apply(void)
+{
+    struct config *o = &conf_applied;
+    bool rebuild, place, paint;
+
+    rebuild = conf.b_width != o->b_width || conf.i_width != o->i_width ||
+        conf.t_height != o->t_height || conf.decorate != o->decorate || conf.reparent != o->reparent;
+    place = conf.top_gap != o->top_gap || conf.bot_gap != o->bot_gap ||
+        conf.left_gap != o->left_gap || conf.right_gap != o->right_gap ||
+        conf.json_status != o->json_status;
+    paint = conf.bf_color != o->bf_color || conf.bu_color != o->bu_color ||
+        conf.if_color != o->if_color || conf.iu_color != o->iu_color ||
+        conf.draw_text != o->draw_text || conf.t_pixmap != o->t_pixmap ||
+        title_gen != title_gen_applied;
+
+    config_staged = false;
+    conf_applied = conf;
+    title_gen_applied = title_gen;
+
+    LOGP("Applying config, rebuild %d place %d paint %d", rebuild, place, paint);
+    if (rebuild || place)
+        refresh_config(rebuild);
+    else if (paint)
+        repaint_config();
+}
+
+/* Apply staged config changes that are due, or a transaction that was
+ * never committed. Called from batch_flush. */
+static void
+config_pending_commit(void)
+{
+    if (!config_staged || now_usec() < config_due)
+        return;
+
+    if (config_txn) {
+        LOGN("Config transaction was not committed in time, applying it");
+        config_txn = false;
+    }
+    config_apply();
+}
+
+/* Milliseconds until the staged config changes are due, -1 if none are */
+static int
+config_pending_timeout(void)
+{
+    uint64_t now;
+
+    if (!config_staged)
+        return -1;
+
+    now = now_usec();
+    return now >= config_due ? 0 : (int)((config_due - now + 999) / 1000);
 }
 
 static void
@@ -1215,6 +2207,11 @@ ipc_save_monitor(long *d)
         return;
     }
 
+    if (ws < 0 || ws >= ws_count) {
+        LOGN("Cannot save monitor, no such workspace");
+        return;
+    }
+
     LOGP("Saving ws %d to monitor %d", ws, mon);
 
     /* Associate the given workspace to the given monitor */
@@ -1231,166 +2228,923 @@ ipc_set_font(long *d)
     int err, n;
     LOGN("Handling new set_font request");
 
+    /* Over the socket the font name comes with the request */
+    if (ipc_payload != NULL) {
+        load_font(ipc_payload);
+        return;
+    }
+
     font_list = NULL;
     LOGN("Getting text property");
-    XGetTextProperty(display, root, &font_prop, net_berry[BerryFontProperty]);
-    LOGN("Converting to text list");
-    err = XmbTextPropertyToTextList(display, &font_prop, &font_list, &n);
-    strncpy(global_font, font_list[0], sizeof(global_font));
-    LOGN("Opening font by name");
-    font = XftFontOpenName(display, screen, global_font);
-    if (font == NULL) {
-        LOGN("Error, could not open font name");
+    if (!XGetTextProperty(display, root, &font_prop, net_berry[BerryFontProperty])) {
+        LOGN("Could not read font property");
         return;
     }
-    refresh_config();
-    if (err >= Success && n > 0 && *font_list)
+    LOGN("Converting to text list");
+    err = XmbTextPropertyToTextList(display, &font_prop, &font_list, &n);
+    if (err >= Success && n > 0 && *font_list) {
+        load_font(font_list[0]);
         XFreeStringList(font_list);
+    }
     XFree(font_prop.value);
 }
 
+/* Name a single desktop. Only sent over the socket, the X path
+ * rewrites _NET_DESKTOP_NAMES from berryc itself.
+ */
 static void
-load_color(XftColor *dest_color, unsigned long raw_color)
+ipc_name_desktop(long *d)
 {
-    XColor x_color;
-    x_color.pixel = raw_color;
-    XQueryColor(display, DefaultColormap(display, screen), &x_color);
-    r_color.blue = x_color.blue;
-    r_color.green = x_color.green;
-    r_color.red = x_color.red;
-    r_color.alpha = DEFAULT_ALPHA;
+    XTextProperty text_prop;
+    char **list = NULL, **names;
+    int idx, n = 0, count;
+
+    idx = d[1];
+    if (ipc_payload == NULL || idx < 0 || idx >= ws_count) {
+        ipc_status = IPCStatusError;
+        return;
+    }
+
+    if (XGetTextProperty(display, root, &text_prop, net_atom[NetDesktopNames])) {
+        Xutf8TextPropertyToTextList(display, &text_prop, &list, &n);
+        XFree(text_prop.value);
+    }
+
+    count = MAX(n, ws_count);
+    names = calloc(count, sizeof(char *));
+    if (names == NULL) {
+        if (list)
+            XFreeStringList(list);
+        return;
+    }
+
+    for (int i = 0; i < count; i++)
+        names[i] = i < n ? list[i] : "";
+    names[idx] = (char *)ipc_payload;
+
+    LOGP("Naming desktop %d %s", idx, ipc_payload);
+    if (Xutf8TextListToTextProperty(display, names, count, XUTF8StringStyle, &text_prop) >= Success) {
+        XSetTextProperty(display, root, &text_prop, net_atom[NetDesktopNames]);
+        XFree(text_prop.value);
+    }
 
-    XftColorFree(display, DefaultVisual(display, screen), DefaultColormap(display, screen), dest_color);
-    XftColorAllocValue(display, DefaultVisual(display, screen), DefaultColormap(display, screen),
-            &r_color, dest_color);
+    free(names);
+    if (list)
+        XFreeStringList(list);
 }
 
+static void
+ipc_trace(long *d)
+{
+    UNUSED(d);
+#if LOG_LEVEL >= LOG_TRACE
+    trace_dump(&ipc_out);
+#else
+    sb_printf(&ipc_out, "berry was built without the event trace, configure it with --loglevel=2\n");
+    ipc_status = IPCStatusError;
+#endif
+}
 
+#if LOG_LEVEL >= LOG_TRACE
+/* Note an event in the ring, overwriting the oldest once it is full */
 static void
-load_config(char *conf_path)
+trace_record(int type, unsigned long window)
 {
-    if (fork() == 0) {
-        setsid();
-        execl("/bin/sh", "sh", conf_path, NULL);
-        LOGP("CONFIG PATH: %s", conf_path);
-    }
+    struct trace_record *r = &trace_ring[trace_head++ & (TRACE_RING_SIZE - 1)];
+
+    r->usec = now_usec();
+    r->window = window;
+    r->type = type;
 }
 
 static void
-client_manage_focus(struct client *c)
+trace_dump(struct strbuf *sb)
 {
-    if (c != NULL && f_client != NULL) {
-        client_set_color(f_client, conf.iu_color, conf.bu_color);
-        draw_text(f_client, false);
-        manage_xsend_icccm(c, wm_atom[WMTakeFocus]);
-    }
+    unsigned int first = trace_head > TRACE_RING_SIZE ? trace_head - TRACE_RING_SIZE : 0;
 
-    if (c != NULL) {
-        client_move_to_front(c);
-        client_set_color(c, conf.if_color, conf.bf_color);
-        draw_text(c, true);
-        client_raise(c);
-        client_set_input(c);
-        if (conf.warp_pointer)
-            warp_pointer(c);
-        ewmh_set_focus(c);
-        manage_xsend_icccm(c, wm_atom[WMTakeFocus]);
-        if (c->ws != curr_ws)
-            switch_ws(c->ws);
-    } else { //client is null, might happen when switching to a new workspace
-             // without any active clients
-        LOGN("Giving focus to dummy window");
-        f_client = NULL;
-        XSetInputFocus(display, nofocus, RevertToPointerRoot, CurrentTime);
+    for (unsigned int i = first; i != trace_head; i++) {
+        struct trace_record *r = &trace_ring[i & (TRACE_RING_SIZE - 1)];
+        sb_printf(sb, "%llu.%06llu %d 0x%lx\n", (unsigned long long)(r->usec / 1000000),
+                (unsigned long long)(r->usec % 1000000), r->type, r->window);
     }
 }
 
 static void
-manage_new_window(Window w, XWindowAttributes *wa)
+trace_signal(int sig)
 {
-    /* Credits to vain for XGWP checking */
-    Atom prop, da;
-    unsigned char *prop_ret = NULL;
-    int di;
-    unsigned long dl;
-    if (XGetWindowProperty(display, w, net_atom[NetWMWindowType], 0,
-                sizeof (Atom), False, XA_ATOM, &da, &di, &dl, &dl,
-                &prop_ret) == Success) {
-        if (prop_ret) {
-            prop = ((Atom *)prop_ret)[0];
-            if ((prop == net_atom[NetWMWindowTypeDock]    && !conf.manage[Dock])    ||
-                (prop == net_atom[NetWMWindowTypeToolbar] && !conf.manage[Toolbar]) ||
-                (prop == net_atom[NetWMWindowTypeUtility] && !conf.manage[Utility]) ||
-                (prop == net_atom[NetWMWindowTypeDialog]  && !conf.manage[Dialog])  ||
-                (prop == net_atom[NetWMWindowTypeMenu]    && !conf.manage[Menu])) {
-                XMapWindow(display, w);
-                LOGN("Window is of type dock, toolbar, utility, menu, or splash: not managing");
-                LOGN("Mapping new window, not managed");
-                return;
-            }
-        }
-    }
+    UNUSED(sig);
+    trace_pending = 1;
+}
+#endif
 
-    // Make sure we aren't trying to map the same window twice
-    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
-        for (struct client *tmp = c_list[i]; tmp; tmp = tmp->next) {
-            if (tmp->window == w) {
-                LOGN("Error, window already mapped. Not mapping.");
-                return;
-            }
-        }
+static void
+ipc_stats(long *d)
+{
+    switch (d[1]) {
+        case 0:
+            sb_printf(&ipc_out, "{");
+            stats_list(&ipc_out, "events", stats_event, LASTEvent + 1);
+            sb_printf(&ipc_out, ",");
+            stats_list(&ipc_out, "commands", stats_ipc, IPCLast);
+            sb_printf(&ipc_out, "}\n");
+            break;
+        case 1:
+            LOGN("Resetting stats");
+            memset(stats_event, 0, sizeof stats_event);
+            memset(stats_ipc, 0, sizeof stats_ipc);
+            break;
+        default:
+            ipc_status = IPCStatusError;
+            break;
     }
+}
 
-    // Get class information for the current window
-    XClassHint ch;
-    if (XGetClassHint(display, w, &ch) > Success) {
-        LOGP("client has class %s", ch.res_class);
-        LOGP("client has name %s", ch.res_name);
-        if (ch.res_class)
-            XFree(ch.res_class);
-        if (ch.res_name)
-            XFree(ch.res_name);
-    } else {
-        LOGN("could not retrieve client class name");
+/* Turn the connection the request came on into an event stream */
+static void
+ipc_subscribe(long *d)
+{
+    unsigned int events = d[1] & ((1u << IPCEventLast) - 1);
+    int subs = 0;
+
+    if (ipc_conn_current == NULL || events == 0) {
+        ipc_status = IPCStatusError;
+        return;
     }
 
-    struct client *c;
-    c = malloc(sizeof(struct client));
-    if (c == NULL) {
-        LOGN("Error, malloc could not allocated new window");
+    for (int i = 0; i < IPC_MAX_CONN; i++)
+        if (ipc_conns[i].fd >= 0 && ipc_conns[i].events != 0)
+            subs++;
+    if (subs >= IPC_MAX_SUB) {
+        LOGN("Too many subscribers, refusing");
+        ipc_status = IPCStatusError;
         return;
     }
-    c->window = w;
-    c->ws = curr_ws;
-    c->geom.x = wa->x;
-    c->geom.y = wa->y;
-    c->geom.width = wa->width + 2 * (conf.b_width + conf.i_width);
-    c->geom.height = wa->height + 2 * (conf.b_width + conf.i_width) + conf.t_height;
-    c->hidden = false;
-    c->fullscreen = false;
-    c->mono = false;
-    c->was_fs = false;
 
-    XSetWindowBorderWidth(display, c->window, 0);
+    LOGP("Control connection %d subscribed to events 0x%x", ipc_conn_current->fd, events);
+    ipc_conn_current->events = events;
+    ipc_conn_current->dropped = 0;
+    event_mask |= events;
+}
 
-    if (conf.decorate)
-        client_decorations_create(c);
+static bool
+ipc_event_wanted(enum IPCEvent ev)
+{
+    return event_mask & (1u << ev);
+}
+
+/* Queue {"event":name,<event_line>} for every subscriber of ev. Queues
+ * are bounded, a subscriber that is behind loses the event instead and
+ * is told how many it lost once it catches up. */
+static void
+ipc_event_send(enum IPCEvent ev)
+{
+    static const char *names[IPCEventLast] = IPC_EVENT_NAMES;
+
+    for (int i = 0; i < IPC_MAX_CONN; i++) {
+        struct ipc_conn *conn = &ipc_conns[i];
+        size_t len = event_line.len + strlen(names[ev]) + 16;
+
+        if (conn->fd < 0 || !(conn->events & (1u << ev)))
+            continue;
+
+        if (conn->dropped > 0 && conn->out.len + len + 48 <= IPC_SUB_MAX_BUFFER) {
+            sb_printf(&conn->out, "{\"event\":\"dropped\",\"count\":%lu}\n", conn->dropped);
+            conn->dropped = 0;
+        }
+        if (conn->dropped > 0 || conn->out.len + len > IPC_SUB_MAX_BUFFER) {
+            conn->dropped++;
+            continue;
+        }
+
+        sb_printf(&conn->out, "{\"event\":\"%s\"%s", names[ev], event_line.len > 0 ? "," : "");
+        sb_append(&conn->out, event_line.buf, event_line.len);
+        sb_printf(&conn->out, "}\n");
+    }
+    event_line.len = 0;
+}
+
+/* An event about one window, naming it and its workspace */
+static void
+ipc_event_window(enum IPCEvent ev, struct client *c)
+{
+    if (!ipc_event_wanted(ev))
+        return;
+
+    sb_printf(&event_line, "\"window\":\"0x%08lx\",\"ws\":%d", c->window, c->ws);
+    ipc_event_send(ev);
+}
+
+/* Start writing whatever the batch queued for subscribers */
+static void
+ipc_events_flush(void)
+{
+    if (event_mask == 0)
+        return;
+
+    for (int i = 0; i < IPC_MAX_CONN; i++)
+        if (ipc_conns[i].fd >= 0 && ipc_conns[i].events != 0 && ipc_conns[i].out.len > 0)
+            ipc_conn_write(&ipc_conns[i]);
+}
+
+static void
+ipc_event_mask_update(void)
+{
+    event_mask = 0;
+    for (int i = 0; i < IPC_MAX_CONN; i++)
+        if (ipc_conns[i].fd >= 0)
+            event_mask |= ipc_conns[i].events;
+}
+
+static uint64_t
+now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Account for one dispatch that started at start, when the next X request
+ * was to be number request */
+static void
+stats_add(struct stats_entry *s, uint64_t start, unsigned long request)
+{
+    uint64_t usec = now_usec() - start;
+    int bucket = 0;
+
+    while (bucket < (int)(sizeof s->hist / sizeof s->hist[0]) - 1 && usec >> (bucket + 1) != 0)
+        bucket++;
+
+    s->count++;
+    s->requests += NextRequest(display) - request;
+    s->usec += usec;
+    s->max_usec = MAX(s->max_usec, usec);
+    s->hist[bucket]++;
+}
+
+/* Every entry that was used as "key":[...], with its index as "id" */
+static void
+stats_list(struct strbuf *sb, const char *key, struct stats_entry *s, int n)
+{
+    bool first = true;
+
+    sb_printf(sb, "\"%s\":[", key);
+    for (int i = 0; i < n; i++) {
+        if (s[i].count == 0)
+            continue;
+        sb_printf(sb, "%s{\"id\":%d,\"count\":%lu,\"usec\":%llu,\"max_usec\":%llu,\"requests\":%lu,\"histogram\":[",
+                first ? "" : ",", i, s[i].count, (unsigned long long)s[i].usec,
+                (unsigned long long)s[i].max_usec, s[i].requests);
+        for (int j = 0; j < (int)(sizeof s[i].hist / sizeof s[i].hist[0]); j++)
+            sb_printf(sb, "%s%lu", j == 0 ? "" : ",", s[i].hist[j]);
+        sb_printf(sb, "]}");
+        first = false;
+    }
+    sb_printf(sb, "]");
+}
+
+/* Answer a query from the in-memory client and monitor lists. The reply
+ * is only delivered over the control socket.
+ */
+static void
+ipc_query(long *d)
+{
+    LOGP("Handling query %ld", d[1]);
+    switch (d[1]) {
+        case IPCQueryWindows:
+            query_windows(&ipc_out);
+            break;
+        case IPCQueryWorkspaces:
+            query_workspaces(&ipc_out);
+            break;
+        case IPCQueryMonitors:
+            query_monitors(&ipc_out);
+            break;
+        case IPCQueryFocused:
+            if (f_list[curr_ws] != NULL)
+                query_client(&ipc_out, f_list[curr_ws]);
+            else
+                sb_printf(&ipc_out, "null");
+            break;
+        default:
+            ipc_status = IPCStatusError;
+            return;
+    }
+    sb_printf(&ipc_out, "\n");
+}
+
+static void
+query_string(struct strbuf *sb, const char *s)
+{
+    sb_printf(sb, "\"");
+    for (; *s != '\0'; s++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\')
+            sb_printf(sb, "\\%c", ch);
+        else if (ch < 0x20)
+            sb_printf(sb, "\\u%04x", ch);
+        else
+            sb_append(sb, s, 1);
+    }
+    sb_printf(sb, "\"");
+}
+
+static void
+query_client(struct strbuf *sb, struct client *c)
+{
+    char *state;
+
+    if (c->fullscreen)
+        state = "fullscreen";
+    else if (c->mono)
+        state = "mono";
+    else if (c->hidden)
+        state = "hidden";
+    else
+        state = "normal";
+
+    sb_printf(sb,
+            "{"
+                "\"window\":\"0x%08lx\","
+                "\"title\":",
+            c->window);
+    query_string(sb, c->title->str);
+    sb_printf(sb,
+                ",\"workspace\":%d,"
+                "\"monitor\":%d,"
+                "\"geom\":{"
+                    "\"x\":%d,"
+                    "\"y\":%d,"
+                    "\"width\":%d,"
+                    "\"height\":%d"
+                "},"
+                "\"state\":\"%s\","
+                "\"decorated\":%s,"
+                "\"focused\":%s"
+            "}",
+            c->ws, ws_m_list[c->ws],
+            c->geom.x, c->geom.y, c->geom.width, c->geom.height,
+            state, c->decorated ? "true" : "false",
+            c == f_list[curr_ws] ? "true" : "false");
+}
+
+/* Every managed client, workspace by workspace in stacking order */
+static void
+query_windows(struct strbuf *sb)
+{
+    bool first = true;
+
+    sb_printf(sb, "[");
+    for (int i = 0; i < ws_count; i++) {
+        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
+            if (!first)
+                sb_printf(sb, ",");
+            query_client(sb, tmp);
+            first = false;
+        }
+    }
+    sb_printf(sb, "]");
+}
+
+static void
+query_workspaces(struct strbuf *sb)
+{
+    sb_printf(sb, "[");
+    for (int i = 0; i < ws_count; i++) {
+        int count = 0;
+        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next)
+            count++;
+
+        sb_printf(sb, "%s{\"id\":%d,\"monitor\":%d,\"current\":%s,\"clients\":%d,\"focused\":",
+                i == 0 ? "" : ",", i, ws_m_list[i], i == curr_ws ? "true" : "false", count);
+        if (f_list[i] != NULL)
+            sb_printf(sb, "\"0x%08lx\"}", f_list[i]->window);
+        else
+            sb_printf(sb, "null}");
+    }
+    sb_printf(sb, "]");
+}
+
+static void
+query_monitors(struct strbuf *sb)
+{
+    sb_printf(sb, "[");
+    for (int i = 0; i < m_count; i++)
+        sb_printf(sb, "%s{\"id\":%d,\"x\":%d,\"y\":%d,\"width\":%d,\"height\":%d}",
+                i == 0 ? "" : ",", i, m_list[i].x, m_list[i].y, m_list[i].width, m_list[i].height);
+    sb_printf(sb, "]");
+}
+
+static void
+load_font(const char *name)
+{
+    struct font_entry *f;
+
+    LOGP("Opening font by name %s", name);
+    f = font_acquire(name);
+    if (f == NULL) {
+        LOGN("Error, could not open font name");
+        ipc_status = IPCStatusError;
+        return;
+    }
+
+    font_release(font_res);
+    if (f == font_res)
+        return;
+
+    snprintf(global_font, sizeof(global_font), "%s", name);
+    font_res = f;
+    font = f->font;
+    title_gen++;
+    /* A freed font's address may come back, so do not trust t_font */
+    for (int i = 0; i < ws_used_count; i++)
+        for (struct client *tmp = c_list[ws_used[i]]; tmp != NULL; tmp = tmp->next)
+            tmp->t_valid = false;
+    res_cache_trim();
+    config_stage();
+}
+
+/* Point dest at the text color for raw_color, returning whether it changed.
+ * The raw value is the same 0xRRGGBB pixel the border colors use. */
+static bool
+load_color(struct color_entry **dest, unsigned long raw_color)
+{
+    struct color_entry *c;
+    char spec[8];
+
+    snprintf(spec, sizeof spec, "#%06lx", raw_color & 0xffffff);
+    c = color_acquire(spec);
+    if (c == NULL) {
+        LOGP("Error, could not allocate color %s", spec);
+        ipc_status = IPCStatusError;
+        return false;
+    }
+
+    color_release(*dest);
+    if (c == *dest)
+        return false;
+
+    *dest = c;
+    res_cache_trim();
+    return true;
+}
+
+/* Fonts and colors are shared by name, so switching back and forth between
+ * themes reuses what is already open rather than going to the server again.
+ * Entries nobody holds stay cached until res_cache_trim drops the oldest. */
+static struct font_entry *
+font_acquire(const char *name)
+{
+    struct font_entry *f;
+    XftFont *xf;
+
+    for (f = font_cache; f != NULL; f = f->next) {
+        if (strcmp(f->name, name) == 0) {
+            f->refs++;
+            return f;
+        }
+    }
+
+    xf = XftFontOpenName(display, screen, name);
+    if (xf == NULL)
+        return NULL;
+
+    f = malloc(sizeof(struct font_entry) + strlen(name) + 1);
+    if (f == NULL) {
+        XftFontClose(display, xf);
+        return NULL;
+    }
+    f->refs = 1;
+    f->font = xf;
+    strcpy(f->name, name);
+    f->next = font_cache;
+    font_cache = f;
+    return f;
+}
+
+static void
+font_release(struct font_entry *f)
+{
+    if (f != NULL && f->refs > 0)
+        f->refs--;
+}
+
+static struct color_entry *
+color_acquire(const char *spec)
+{
+    struct color_entry *c;
+
+    for (c = color_cache; c != NULL; c = c->next) {
+        if (strcmp(c->spec, spec) == 0) {
+            c->refs++;
+            return c;
+        }
+    }
+
+    c = malloc(sizeof(struct color_entry) + strlen(spec) + 1);
+    if (c == NULL)
+        return NULL;
+    if (!XftColorAllocName(display, DefaultVisual(display, screen), DefaultColormap(display, screen),
+                spec, &c->color)) {
+        free(c);
+        return NULL;
+    }
+    c->refs = 1;
+    strcpy(c->spec, spec);
+    c->next = color_cache;
+    color_cache = c;
+    return c;
+}
+
+static void
+color_release(struct color_entry *c)
+{
+    if (c != NULL && c->refs > 0)
+        c->refs--;
+}
+
+/* Free unused entries past the first RES_CACHE_MAX of each cache. New
+ * entries go on the front, so the ones dropped were opened longest ago. */
+static void
+res_cache_trim(void)
+{
+    int n = 0;
+
+    for (struct font_entry **f = &font_cache; *f != NULL;) {
+        struct font_entry *tmp = *f;
+        if (tmp->refs == 0 && ++n > RES_CACHE_MAX) {
+            *f = tmp->next;
+            XftFontClose(display, tmp->font);
+            free(tmp);
+        } else {
+            f = &tmp->next;
+        }
+    }
+
+    n = 0;
+    for (struct color_entry **c = &color_cache; *c != NULL;) {
+        struct color_entry *tmp = *c;
+        if (tmp->refs == 0 && ++n > RES_CACHE_MAX) {
+            *c = tmp->next;
+            XftColorFree(display, DefaultVisual(display, screen), DefaultColormap(display, screen), &tmp->color);
+            free(tmp);
+        } else {
+            c = &tmp->next;
+        }
+    }
+}
+
+static void
+res_cache_free(void)
+{
+    while (font_cache != NULL) {
+        struct font_entry *next = font_cache->next;
+        XftFontClose(display, font_cache->font);
+        free(font_cache);
+        font_cache = next;
+    }
+
+    while (color_cache != NULL) {
+        struct color_entry *next = color_cache->next;
+        XftColorFree(display, DefaultVisual(display, screen), DefaultColormap(display, screen), &color_cache->color);
+        free(color_cache);
+        color_cache = next;
+    }
+}
+
+
+static void
+load_config(char *conf_path)
+{
+    if (fork() == 0) {
+        setsid();
+        execl("/bin/sh", "sh", conf_path, NULL);
+        LOGP("CONFIG PATH: %s", conf_path);
+    }
+}
+
+static void
+client_manage_focus(struct client *c)
+{
+    struct client *prev = f_client;
+
+    /* Focus given any other way wins over the pointer's */
+    focus_pending = NULL;
+
+    if (c != NULL && f_client != NULL && f_client != c) {
+        client_set_color(f_client, conf.iu_color, conf.bu_color);
+        draw_text(f_client, false);
+    }
+
+    if (c != NULL) {
+        client_move_to_front(c);
+        client_set_color(c, conf.if_color, conf.bf_color);
+        draw_text(c, true);
+        client_raise(c);
+        client_set_input(c);
+        if (conf.warp_pointer)
+            warp_pointer(c);
+        ewmh_set_focus(c);
+        manage_xsend_icccm(c, wm_atom[WMTakeFocus]);
+        if (c->ws != curr_ws)
+            switch_ws(c->ws);
+    } else { //client is null, might happen when switching to a new workspace
+             // without any active clients
+        LOGN("Giving focus to dummy window");
+        f_client = NULL;
+        XSetInputFocus(display, nofocus, RevertToPointerRoot, CurrentTime);
+    }
+
+    if (f_client != prev && ipc_event_wanted(IPCEventFocus)) {
+        if (f_client != NULL)
+            sb_printf(&event_line, "\"window\":\"0x%08lx\",\"ws\":%d", f_client->window, f_client->ws);
+        else
+            sb_printf(&event_line, "\"window\":null");
+        ipc_event_send(IPCEventFocus);
+    }
+}
+
+/* Whether windows of the given _NET_WM_WINDOW_TYPE are managed */
+static bool
+manage_window_type(Atom type)
+{
+    return !((type == net_atom[NetWMWindowTypeDock]    && !conf.manage[Dock])    ||
+             (type == net_atom[NetWMWindowTypeToolbar] && !conf.manage[Toolbar]) ||
+             (type == net_atom[NetWMWindowTypeUtility] && !conf.manage[Utility]) ||
+             (type == net_atom[NetWMWindowTypeDialog]  && !conf.manage[Dialog])  ||
+             (type == net_atom[NetWMWindowTypeMenu]    && !conf.manage[Menu]));
+}
+
+static void
+manage_new_window(Window w, XWindowAttributes *wa)
+{
+    xcb_connection_t *xc = XGetXCBConnection(display);
+    struct manage_cookies ck;
+    struct manage_props p;
+
+    // Make sure we aren't trying to map the same window twice
+    struct client *dup = get_client_from_window(w);
+    if (dup != NULL && dup->window == w) {
+        LOGN("Error, window already mapped. Not mapping.");
+        return;
+    }
+
+    /* Everything we need to know goes out in one flight */
+    manage_props_request(xc, w, &ck);
+    manage_props_collect(xc, &ck, &p);
+
+    if (p.type != None && !manage_window_type(p.type)) {
+        XMapWindow(display, w);
+        LOGN("Window is of type dock, toolbar, utility, menu, or splash: not managing");
+        LOGN("Mapping new window, not managed");
+        return;
+    }
+
+    struct client *c = client_create(w, wa, curr_ws, false, &p);
+    if (c == NULL)
+        return;
 
-    client_set_title(c);
-    client_refresh(c); /* using our current factoring, w/h are set incorrectly */
-    client_save(c, curr_ws);
     client_place(c);
-    ewmh_set_desktop(c, c->ws);
     ewmh_set_client_list();
+    client_map(c);
+    client_manage_focus(c);
+}
+
+/* Send the property requests for a window without waiting on them */
+static void
+manage_props_request(xcb_connection_t *xc, Window w, struct manage_cookies *ck)
+{
+    ck->type = xcb_get_property(xc, 0, w, net_atom[NetWMWindowType], XCB_ATOM_ATOM, 0, 1);
+    ck->class = xcb_get_property(xc, 0, w, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 0, 64);
+    ck->desktop = xcb_get_property(xc, 0, w, net_atom[NetWMDesktop], XCB_ATOM_CARDINAL, 0, 1);
+    ck->name = xcb_get_property(xc, 0, w, net_atom[NetWMName], XCB_GET_PROPERTY_TYPE_ANY, 0, 128);
+    ck->protocols = xcb_get_property(xc, 0, w, wm_atom[WMProtocols], XCB_ATOM_ATOM, 0, 32);
+    ck->counter = xcb_get_property(xc, 0, w, net_atom[NetWMSyncRequestCounter], XCB_ATOM_CARDINAL, 0, 1);
+}
+
+/* A 32 bit property's first value, or def if it has none */
+static uint32_t
+manage_prop_long(xcb_get_property_reply_t *r, uint32_t def)
+{
+    if (r == NULL || r->format != 32 || xcb_get_property_value_length(r) < 4)
+        return def;
+    return *(uint32_t *)xcb_get_property_value(r);
+}
+
+/* Wait for the replies to manage_props_request */
+static void
+manage_props_collect(xcb_connection_t *xc, struct manage_cookies *ck, struct manage_props *p)
+{
+    xcb_get_property_reply_t *type = xcb_get_property_reply(xc, ck->type, NULL);
+    xcb_get_property_reply_t *class = xcb_get_property_reply(xc, ck->class, NULL);
+    xcb_get_property_reply_t *desktop = xcb_get_property_reply(xc, ck->desktop, NULL);
+    xcb_get_property_reply_t *name = xcb_get_property_reply(xc, ck->name, NULL);
+    xcb_get_property_reply_t *protocols = xcb_get_property_reply(xc, ck->protocols, NULL);
+    xcb_get_property_reply_t *counter = xcb_get_property_reply(xc, ck->counter, NULL);
+
+    p->type = manage_prop_long(type, None);
+    p->desktop = manage_prop_long(desktop, -1);
+    p->counter = manage_prop_long(counter, None);
+
+    // Get class information for the current window
+    if (class != NULL && xcb_get_property_value_length(class) > 0) {
+        char *v = xcb_get_property_value(class);
+        int len = xcb_get_property_value_length(class);
+        int n = strnlen(v, len);
+        LOGP("client has class %.*s", n + 1 < len ? (int)strnlen(v + n + 1, len - n - 1) : 0, v + n + 1);
+        LOGP("client has name %.*s", n, v);
+    } else {
+        LOGN("could not retrieve client class name");
+    }
+
+    p->has_title = false;
+    if (name != NULL && name->type != XCB_NONE) {
+        XTextProperty tp = {
+            .value = xcb_get_property_value(name),
+            .encoding = name->type,
+            .format = name->format,
+            .nitems = xcb_get_property_value_length(name) / (name->format / 8),
+        };
+        p->has_title = title_from_property(p->title, sizeof p->title, &tp);
+    }
+
+    p->protocols = 0;
+    if (protocols != NULL && protocols->format == 32) {
+        xcb_atom_t *atoms = xcb_get_property_value(protocols);
+        int n = xcb_get_property_value_length(protocols) / 4;
+        for (int i = 0; i < n; i++)
+            p->protocols |= protocol_bit(atoms[i]);
+    }
+
+    free(type);
+    free(class);
+    free(desktop);
+    free(name);
+    free(protocols);
+    free(counter);
+}
+
+/* Set up a client for the window and file it on the given workspace.
+ * The client is not placed, mapped or published in _NET_CLIENT_LIST.
+ */
+static struct client *
+client_create(Window w, XWindowAttributes *wa, int ws, bool mapped, struct manage_props *p)
+{
+    struct client *c;
+    c = client_alloc();
+    if (c == NULL) {
+        LOGN("Error, malloc could not allocated new window");
+        return NULL;
+    }
+    c->window = w;
+    c->dec = None;
+    c->decorated = false;
+    c->framed = false;
+    c->mapped = mapped;
+    c->ignore_unmap = 0;
+    c->protocols = p->protocols;
+    c->p_valid = true;
+    c->draw = NULL;
+    c->t_valid = false;
+    c->t_pm[0] = c->t_pm[1] = None;
+    c->t_pm_gen[0] = c->t_pm_gen[1] = 0;
+    c->t_pm_cap = c->t_pm_h = 0;
+    c->s_next = NULL;
+    c->next = c->c_prev = c->f_next = c->f_prev = NULL;
+    c->s_dirty = false;
+    c->s_len = 0;
+    c->w_sent.width = c->d_sent.width = 0;
+    c->sync_counter = p->counter;
+    c->sync_alarm = None;
+    c->sync_wait = false;
+    c->indexed = false;
+    c->p_cells.width = 0;
+    client_sync_setup(c);
+    c->ws = ws;
+    c->geom.x = wa->x;
+    c->geom.y = wa->y;
+    c->geom.width = wa->width + 2 * (conf.b_width + conf.i_width);
+    c->geom.height = wa->height + 2 * (conf.b_width + conf.i_width) + conf.t_height;
+    c->hidden = false;
+    c->fullscreen = false;
+    c->mono = false;
+    c->was_fs = false;
+    /* Drawing the new decorations already lays out the title */
+    c->title = title_intern(p->has_title ? p->title : "");
+
+    XSetWindowBorderWidth(display, c->window, 0);
+    /* Reparenting a mapped window below makes it unmap, and only the
+     * window's own copy of that UnmapNotify is matched against
+     * ignore_unmap. client_map selects the rest of the mask. */
+    XSelectInput(display, c->window, StructureNotifyMask);
+
+    if (conf.decorate)
+        client_decorations_create(c);
+
+    client_refresh(c); /* using our current factoring, w/h are set incorrectly */
+    client_save(c, ws);
+    ewmh_set_desktop(c, c->ws);
+    return c;
+}
+
+static void
+client_map(struct client *c)
+{
+    if (c->decorated)
+        XMapWindow(display, c->dec);
+
+    XMapWindow(display, c->window);
+    c->mapped = true;
+    ipc_event_window(IPCEventMap, c);
+    XSelectInput(display, c->window, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
+    XGrabButton(display, 1, conf.move_mask, c->window, True, ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
+    XGrabButton(display, 1, conf.resize_mask, c->window, True, ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
+}
+
+/* Take over the windows that are already on screen when we start, e.g.
+ * after a restart. The lookups manage_new_window does one at a time are
+ * all sent up front through xcb and their replies collected afterwards,
+ * so the whole scan costs a couple of round trips.
+ */
+static void
+manage_existing_windows(void)
+{
+    xcb_connection_t *xc = XGetXCBConnection(display);
+    xcb_query_tree_reply_t *tree;
+    xcb_window_t *children;
+    struct manage_cookies *ck;
+    int n, adopted = 0;
+
+    tree = xcb_query_tree_reply(xc, xcb_query_tree(xc, root), NULL);
+    if (tree == NULL)
+        return;
+
+    n = xcb_query_tree_children_length(tree);
+    children = xcb_query_tree_children(tree);
+    ck = malloc(MAX(n, 1) * sizeof(struct manage_cookies));
+    if (ck == NULL) {
+        free(tree);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        ck[i].attr = xcb_get_window_attributes(xc, children[i]);
+        ck[i].geom = xcb_get_geometry(xc, children[i]);
+        manage_props_request(xc, children[i], &ck[i]);
+    }
+
+    for (int i = 0; i < n; i++) {
+        xcb_get_window_attributes_reply_t *attr = xcb_get_window_attributes_reply(xc, ck[i].attr, NULL);
+        xcb_get_geometry_reply_t *geom = xcb_get_geometry_reply(xc, ck[i].geom, NULL);
+        struct manage_props p;
+        int ws = curr_ws;
+
+        manage_props_collect(xc, &ck[i], &p);
+
+        /* Only windows a client asked to have shown, and not our own */
+        if (attr == NULL || geom == NULL || attr->override_redirect ||
+                attr->map_state != XCB_MAP_STATE_VIEWABLE || children[i] == check)
+            goto next;
+        if (p.type != None && !manage_window_type(p.type)) {
+            LOGN("Existing window is of a type we don't manage");
+            goto next;
+        }
+        if (p.desktop >= 0 && p.desktop < ws_count)
+            ws = p.desktop;
+
+        /* Keep the window where it is, the decoration goes around it */
+        XWindowAttributes wa = { .x = geom->x, .y = geom->y, .width = geom->width, .height = geom->height };
+        if (conf.decorate) {
+            wa.x -= conf.i_width + conf.b_width;
+            wa.y -= conf.i_width + conf.b_width + conf.t_height;
+        }
 
-    if (conf.decorate)
-        XMapWindow(display, c->dec);
+        struct client *c = client_create(children[i], &wa, ws, true, &p);
+        if (c != NULL) {
+            /* Left off screen, e.g. hidden by a berry that did not exit
+             * cleanly, where switch_ws would never bring it back from */
+            if (!monitors_overlap(geom->x, geom->y, geom->width, geom->height)) {
+                LOGN("Existing window is off screen, centering it");
+                client_center(c);
+            }
+            client_map(c);
+            adopted++;
+        }
 
-    XMapWindow(display, c->window);
-    XSelectInput(display, c->window, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
-    XGrabButton(display, 1, conf.move_mask, c->window, True, ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
-    XGrabButton(display, 1, conf.resize_mask, c->window, True, ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
-    client_manage_focus(c);
+next:
+        free(attr);
+        free(geom);
+    }
+
+    free(ck);
+    free(tree);
+
+    LOGP("Adopted %d existing windows", adopted);
+    if (adopted > 0) {
+        ewmh_set_client_list();
+        /* Hide whatever belongs to workspaces that aren't shown */
+        switch_ws(curr_ws);
+    }
 }
 
 static int
@@ -1399,17 +3153,9 @@ manage_xsend_icccm(struct client *c, Atom atom)
     /* This is from a dwm patch by Brendan MacDonell:
      * http://lists.suckless.org/dev/1104/7548.html */
 
-    int n;
-    Atom *protocols;
-    int exists = 0;
+    int exists = (client_protocols(c) & protocol_bit(atom)) != 0;
     XEvent ev;
 
-    if (XGetWMProtocols(display, c->window, &protocols, &n)) {
-        while (!exists && n--)
-            exists = protocols[n] == atom;
-        XFree(protocols);
-    }
-
     if (exists) {
         ev.type = ClientMessage;
         ev.xclient.window = c->window;
@@ -1423,11 +3169,42 @@ manage_xsend_icccm(struct client *c, Atom atom)
     return exists;
 }
 
+static unsigned int
+protocol_bit(Atom atom)
+{
+    if (atom == wm_atom[WMDeleteWindow])
+        return ProtoDeleteWindow;
+    if (atom == wm_atom[WMTakeFocus])
+        return ProtoTakeFocus;
+    if (atom == net_atom[NetWMSyncRequest])
+        return ProtoSyncRequest;
+    return 0;
+}
+
+/* The client's WM_PROTOCOLS, fetched again only after they changed */
+static unsigned int
+client_protocols(struct client *c)
+{
+    Atom *protocols;
+    int n;
+
+    if (!c->p_valid) {
+        c->protocols = 0;
+        if (XGetWMProtocols(display, c->window, &protocols, &n)) {
+            while (n--)
+                c->protocols |= protocol_bit(protocols[n]);
+            XFree(protocols);
+        }
+        c->p_valid = true;
+    }
+    return c->protocols;
+}
+
 static void
 grab_buttons(void)
 {
-    for (int i = 0; i < WORKSPACE_NUMBER; i++)
-        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
+    for (int i = 0; i < ws_used_count; i++)
+        for (struct client *tmp = c_list[ws_used[i]]; tmp != NULL; tmp = tmp->next) {
             XGrabButton(display, 1, conf.move_mask, tmp->window, True, ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
             XGrabButton(display, 1, conf.resize_mask, tmp->window, True, ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
         }
@@ -1436,32 +3213,111 @@ grab_buttons(void)
 static void
 ungrab_buttons(void)
 {
-    for (int i = 0; i < WORKSPACE_NUMBER; i++)
-        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
+    for (int i = 0; i < ws_used_count; i++)
+        for (struct client *tmp = c_list[ws_used[i]]; tmp != NULL; tmp = tmp->next) {
             XUngrabButton(display, 1, conf.move_mask, tmp->window);
             XUngrabButton(display, 1, conf.resize_mask, tmp->window);
         }
 }
 
+/* Send the client's geometry to its window and decoration. Only the
+ * fields that differ from what was last sent go out, in a single
+ * XConfigureWindow per window.
+ */
+static void
+client_configure_windows(struct client *c)
+{
+    struct client_geom *g = &c->geom;
+
+    place_rects_dirty(c->ws);
+
+    if (c->framed) {
+        /* Only the frame moves, the window keeps its place inside of it */
+        unsigned int frame = configure_window(c->dec, &c->d_sent, g->x, g->y,
+                MAX(g->width - (2 * conf.b_width), MINIMUM_DIM),
+                MAX(g->height - (2 * conf.b_width), MINIMUM_DIM));
+        unsigned int win = configure_window(c->window, &c->w_sent,
+                conf.i_width, conf.i_width + conf.t_height,
+                MAX(g->width - (2 * conf.i_width) - (2 * conf.b_width), MINIMUM_DIM),
+                MAX(g->height - (2 * conf.i_width) - (2 * conf.b_width) - conf.t_height, MINIMUM_DIM));
+        /* A resize reaches the window by itself, a move only the frame */
+        if ((frame & (CWX|CWY)) && !(win & (CWWidth|CWHeight)))
+            client_send_configure(c);
+    } else if (c->decorated) {
+        /* move relative to where decorations should go */
+        configure_window(c->window, &c->w_sent,
+                g->x + conf.i_width + conf.b_width,
+                g->y + conf.i_width + conf.b_width + conf.t_height,
+                MAX(g->width - (2 * conf.i_width) - (2 * conf.b_width), MINIMUM_DIM),
+                MAX(g->height - (2 * conf.i_width) - (2 * conf.b_width) - conf.t_height, MINIMUM_DIM));
+        configure_window(c->dec, &c->d_sent, g->x, g->y,
+                MAX(g->width - (2 * conf.b_width), MINIMUM_DIM),
+                MAX(g->height - (2 * conf.b_width), MINIMUM_DIM));
+    } else {
+        configure_window(c->window, &c->w_sent, g->x, g->y,
+                MAX(g->width, MINIMUM_DIM), MAX(g->height, MINIMUM_DIM));
+    }
+}
+
+/* ICCCM 4.1.5, a synthetic ConfigureNotify with the window's root
+ * coordinates for when it was moved without being configured itself */
 static void
-client_move_absolute(struct client *c, int x, int y)
+client_send_configure(struct client *c)
+{
+    XEvent ev;
+
+    memset(&ev, 0, sizeof ev);
+    ev.type = ConfigureNotify;
+    ev.xconfigure.event = c->window;
+    ev.xconfigure.window = c->window;
+    ev.xconfigure.x = c->geom.x + conf.i_width + conf.b_width;
+    ev.xconfigure.y = c->geom.y + conf.i_width + conf.b_width + conf.t_height;
+    ev.xconfigure.width = c->w_sent.width;
+    ev.xconfigure.height = c->w_sent.height;
+    ev.xconfigure.border_width = 0;
+    ev.xconfigure.above = None;
+    ev.xconfigure.override_redirect = False;
+    XSendEvent(display, c->window, False, StructureNotifyMask, &ev);
+}
+
+/* Returns the mask of fields that were sent */
+static unsigned int
+configure_window(Window w, struct client_geom *sent, int x, int y, int width, int height)
 {
-    int dest_x = x;
-    int dest_y = y;
+    XWindowChanges wc = { .x = x, .y = y, .width = width, .height = height };
+    unsigned int mask = 0;
 
-    if (c->decorated) {
-        dest_x = x + conf.i_width + conf.b_width;
-        dest_y = y + conf.i_width + conf.b_width + conf.t_height;
+    if (sent->width == 0) {
+        mask = CWX | CWY | CWWidth | CWHeight;
+    } else {
+        if (sent->x != x)
+            mask |= CWX;
+        if (sent->y != y)
+            mask |= CWY;
+        if (sent->width != width)
+            mask |= CWWidth;
+        if (sent->height != height)
+            mask |= CWHeight;
     }
 
-    /* move relative to where decorations should go */
-    XMoveWindow(display, c->window, dest_x, dest_y);
-    if (c->decorated){
-        XMoveWindow(display, c->dec, x, y);
-    }
+    if (mask == 0)
+        return 0;
 
+    XConfigureWindow(display, w, mask, &wc);
+    sent->x = x;
+    sent->y = y;
+    sent->width = width;
+    sent->height = height;
+    return mask;
+}
+
+static void
+client_move_absolute(struct client *c, int x, int y)
+{
     c->geom.x = x;
     c->geom.y = y;
+    ws_index_update(c);
+    client_configure_windows(c);
 
     if (c->mono)
         c->mono = false;
@@ -1471,6 +3327,16 @@ client_move_absolute(struct client *c, int x, int y)
 
 static void
 client_move_relative(struct client *c, int x, int y)
+{
+    struct client_geom g = c->geom;
+
+    client_lock_move(c, &g, x, y);
+    client_move_absolute(c, g.x, g.y);
+}
+
+/* Work out where moving g by x, y ends up */
+static void
+client_lock_move(struct client *c, struct client_geom *g, int x, int y)
 {
     /* Constrain the current client to the w/h of display */
     /* God this is soooo ugly */
@@ -1479,26 +3345,28 @@ client_move_relative(struct client *c, int x, int y)
         mon = ws_m_list[c->ws];
 
         /* Lock on the right side of the screen */
-        if (c->geom.x + c->geom.width + x > m_list[mon].width + m_list[mon].x - conf.right_gap)
-            dx = m_list[mon].width + m_list[mon].x - c->geom.width - conf.right_gap;
+        if (g->x + g->width + x > m_list[mon].width + m_list[mon].x - conf.right_gap)
+            dx = m_list[mon].width + m_list[mon].x - g->width - conf.right_gap;
         /* Lock on the left side of the screen */
-        else if (c->geom.x + x < m_list[mon].x + conf.left_gap)
+        else if (g->x + x < m_list[mon].x + conf.left_gap)
             dx = m_list[mon].x + conf.left_gap;
         else
-            dx = c->geom.x + x;
+            dx = g->x + x;
 
         /* Lock on the bottom of the screen */
-        if (c->geom.y + c->geom.height + y > m_list[mon].height + m_list[mon].y - conf.bot_gap)
-            dy = m_list[mon].height + m_list[mon].y - conf.bot_gap - c->geom.height;
+        if (g->y + g->height + y > m_list[mon].height + m_list[mon].y - conf.bot_gap)
+            dy = m_list[mon].height + m_list[mon].y - conf.bot_gap - g->height;
         /* Lock on the top of the screen */
-        else if (c->geom.y + y < m_list[mon].y + conf.top_gap)
+        else if (g->y + y < m_list[mon].y + conf.top_gap)
             dy = m_list[mon].y + conf.top_gap;
         else
-            dy = c->geom.y + y;
+            dy = g->y + y;
 
-        client_move_absolute(c, dx, dy);
+        g->x = dx;
+        g->y = dy;
     } else {
-        client_move_absolute(c, c->geom.x + x, c->geom.y + y);
+        g->x += x;
+        g->y += y;
     }
 }
 
@@ -1513,20 +3381,109 @@ client_move_to_front(struct client *c)
         return;
 
     /* If the Client is at the front of the list, ignore command */
-    if (c_list[ws] == c || c_list[ws]->next == NULL)
+    if (c_list[ws] == c)
         return;
 
-    struct client *tmp;
-    for (tmp = c_list[ws]; tmp->next != NULL; tmp = tmp->next)
-        if (tmp->next == c)
-            break;
+    stack_unlink(c);
+    stack_push(c, ws);
+    WS_LISTS_CHECK(ws);
+}
 
-    if (tmp && tmp->next)
-        tmp->next = tmp->next->next; /* remove the Client from the list */
-    c->next = c_list[ws]; /* add the client to the front of the list */
+/* Both orders are doubly linked, from c_list/f_list to c_tail/f_tail,
+ * so taking a client out or putting it in front is constant time
+ * however many clients the workspace has.
+ */
+static void
+stack_push(struct client *c, int ws)
+{
+    c->c_prev = NULL;
+    c->next = c_list[ws];
+    if (c_list[ws] != NULL)
+        c_list[ws]->c_prev = c;
+    else
+        c_tail[ws] = c;
     c_list[ws] = c;
 }
 
+static void
+stack_unlink(struct client *c)
+{
+    int ws = c->ws;
+
+    /* Not in the list */
+    if (c->c_prev == NULL && c_list[ws] != c)
+        return;
+
+    if (c->c_prev != NULL)
+        c->c_prev->next = c->next;
+    else
+        c_list[ws] = c->next;
+    if (c->next != NULL)
+        c->next->c_prev = c->c_prev;
+    else
+        c_tail[ws] = c->c_prev;
+    c->next = c->c_prev = NULL;
+}
+
+static void
+focus_push(struct client *c, int ws)
+{
+    c->f_prev = NULL;
+    c->f_next = f_list[ws];
+    if (f_list[ws] != NULL)
+        f_list[ws]->f_prev = c;
+    else
+        f_tail[ws] = c;
+    f_list[ws] = c;
+}
+
+static void
+focus_unlink(struct client *c)
+{
+    int ws = c->ws;
+
+    if (c->f_prev == NULL && f_list[ws] != c)
+        return;
+
+    if (c->f_prev != NULL)
+        c->f_prev->f_next = c->f_next;
+    else
+        f_list[ws] = c->f_next;
+    if (c->f_next != NULL)
+        c->f_next->f_prev = c->f_prev;
+    else
+        f_tail[ws] = c->f_prev;
+    c->f_next = c->f_prev = NULL;
+}
+
+#ifndef NDEBUG
+/* Debug builds check the lists of a workspace after every change */
+static void
+ws_lists_check(int ws)
+{
+    struct client *prev = NULL;
+    int stacked = 0, focusable = 0, pos = ws_used_pos[ws];
+
+    for (struct client *tmp = c_list[ws]; tmp != NULL; prev = tmp, tmp = tmp->next) {
+        assert(tmp->ws == ws);
+        assert(tmp->c_prev == prev);
+        stacked++;
+    }
+    assert(c_tail[ws] == prev);
+
+    prev = NULL;
+    for (struct client *tmp = f_list[ws]; tmp != NULL; prev = tmp, tmp = tmp->f_next) {
+        assert(tmp->ws == ws);
+        assert(tmp->f_prev == prev);
+        focusable++;
+    }
+    assert(f_tail[ws] == prev);
+
+    assert(stacked == focusable);
+    assert((stacked > 0) == (pos < ws_used_count && ws_used[pos] == ws));
+}
+#endif
+
 static void
 client_monocle(struct client *c)
 {
@@ -1546,8 +3503,458 @@ client_monocle(struct client *c)
     }
 }
 
+/* Index of the first client in list whose key is at least key */
+static int
+ws_index_find(struct client **list, int n, int key, bool by_y)
+{
+    int lo = 0, hi = n;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if ((by_y ? list[mid]->i_y : list[mid]->i_x) < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Move c, filed under old, to where key belongs in the sorted list */
+static void
+ws_index_shift(struct client **list, int n, struct client *c, int old, int key, bool by_y)
+{
+    int from, to;
+
+    for (from = ws_index_find(list, n, old, by_y); from < n && list[from] != c; from++)
+        ;
+    if (from == n)
+        return;
+
+    memmove(&list[from], &list[from + 1], (n - from - 1) * sizeof(*list));
+    if (by_y)
+        c->i_y = key;
+    else
+        c->i_x = key;
+    to = ws_index_find(list, n - 1, key, by_y);
+    memmove(&list[to + 1], &list[to], (n - 1 - to) * sizeof(*list));
+    list[to] = c;
+}
+
+static void
+ws_index_insert(int ws, struct client *c)
+{
+    struct ws_index *wi = &ws_index[ws];
+    int pos;
+
+    if (wi->count == wi->size) {
+        int size = wi->size == 0 ? WIN_INDEX_INITIAL : wi->size * 2;
+        struct client **x = realloc(wi->by_x, size * sizeof(*x));
+        if (x == NULL)
+            return;
+        wi->by_x = x;
+        struct client **y = realloc(wi->by_y, size * sizeof(*y));
+        if (y == NULL)
+            return;
+        wi->by_y = y;
+        wi->size = size;
+    }
+
+    c->i_x = c->geom.x;
+    c->i_y = c->geom.y;
+
+    pos = ws_index_find(wi->by_x, wi->count, c->i_x, false);
+    memmove(&wi->by_x[pos + 1], &wi->by_x[pos], (wi->count - pos) * sizeof(*wi->by_x));
+    wi->by_x[pos] = c;
+
+    pos = ws_index_find(wi->by_y, wi->count, c->i_y, true);
+    memmove(&wi->by_y[pos + 1], &wi->by_y[pos], (wi->count - pos) * sizeof(*wi->by_y));
+    wi->by_y[pos] = c;
+
+    wi->count++;
+    c->indexed = true;
+}
+
+static void
+ws_index_remove(struct client *c)
+{
+    struct ws_index *wi;
+
+    if (!c->indexed)
+        return;
+
+    /* Shifting to the largest key leaves c last, where it is dropped */
+    wi = &ws_index[c->ws];
+    ws_index_shift(wi->by_x, wi->count, c, c->i_x, INT_MAX, false);
+    ws_index_shift(wi->by_y, wi->count, c, c->i_y, INT_MAX, true);
+    wi->count--;
+    c->indexed = false;
+}
+
+/* Refile a client whose position changed */
+static void
+ws_index_update(struct client *c)
+{
+    struct ws_index *wi;
+
+    if (!c->indexed)
+        return;
+
+    wi = &ws_index[c->ws];
+    if (c->i_x != c->geom.x)
+        ws_index_shift(wi->by_x, wi->count, c, c->i_x, c->geom.x, false);
+    if (c->i_y != c->geom.y)
+        ws_index_shift(wi->by_y, wi->count, c, c->i_y, c->geom.y, true);
+}
+
+/* Find the closest client strictly to the given direction of c on the
+ * current workspace. Clients are walked outwards along the matching axis
+ * and the walk stops once that axis alone is further than the best match.
+ */
+static struct client*
+ws_index_nearest(struct client *c, int dir)
+{
+    struct ws_index *wi = &ws_index[curr_ws];
+    struct client **list, *best = NULL;
+    unsigned min = UINT_MAX;
+    bool by_y = dir == NORTH || dir == SOUTH;
+    bool forward = dir == EAST || dir == SOUTH;
+    int key = by_y ? c->geom.y : c->geom.x;
+    int i, step;
+
+    list = by_y ? wi->by_y : wi->by_x;
+    if (forward) {
+        i = ws_index_find(list, wi->count, key + 1, by_y);
+        step = 1;
+    } else {
+        i = ws_index_find(list, wi->count, key, by_y) - 1;
+        step = -1;
+    }
+
+    for (; i >= 0 && i < wi->count; i += step) {
+        struct client *tmp = list[i];
+        long d = (by_y ? tmp->geom.y : tmp->geom.x) - key;
+
+        if ((unsigned long)(d * d) >= min)
+            break;
+        unsigned dist = euclidean_distance(c, tmp);
+        if (dist < min) {
+            min = dist;
+            best = tmp;
+        }
+    }
+
+    return best;
+}
+
+/* Bring the workspace's placement grid up to date with every client
+ * but c. Only clients that moved since the last placement are redrawn
+ * into it, the grid is only rebuilt when the monitor changes.
+ */
+static bool
+place_grid_sync(struct client *c, int mon)
+{
+    struct place_grid *g = &p_grid[c->ws];
+    int x = m_list[mon].x / PLACE_RES, y = m_list[mon].y / PLACE_RES;
+    int width = m_list[mon].width / PLACE_RES, height = m_list[mon].height / PLACE_RES;
+
+    if (g->cells == NULL || g->x != x || g->y != y || g->width != width || g->height != height) {
+        free(g->cells);
+        free(g->run);
+        g->cells = calloc((size_t)width * height, sizeof(*g->cells));
+        g->run = calloc(width, sizeof(*g->run));
+        if (g->cells == NULL || g->run == NULL) {
+            free(g->cells);
+            free(g->run);
+            g->cells = g->run = NULL;
+            return false;
+        }
+        g->x = x;
+        g->y = y;
+        g->width = width;
+        g->height = height;
+        for (struct client *tmp = c_list[c->ws]; tmp != NULL; tmp = tmp->next)
+            tmp->p_cells.width = 0;
+    }
+
+    for (struct client *tmp = c_list[c->ws]; tmp != NULL; tmp = tmp->next) {
+        struct client_geom cells = { 0 };
+
+        if (tmp != c) {
+            cells.x = tmp->geom.x / PLACE_RES;
+            cells.y = tmp->geom.y / PLACE_RES;
+            cells.width = tmp->geom.width / PLACE_RES;
+            cells.height = tmp->geom.height / PLACE_RES;
+        }
+
+        if (cells.x == tmp->p_cells.x && cells.y == tmp->p_cells.y &&
+            cells.width == tmp->p_cells.width && cells.height == tmp->p_cells.height)
+            continue;
+
+        place_grid_mark(g, &tmp->p_cells, -1);
+        place_grid_mark(g, &cells, 1);
+        tmp->p_cells = cells;
+    }
+
+    return true;
+}
+
+/* Add delta to every grid cell covered by the given cell rectangle */
+static void
+place_grid_mark(struct place_grid *g, struct client_geom *cells, int delta)
+{
+    int x0, y0, x1, y1;
+
+    if (cells->width <= 0 || cells->height <= 0)
+        return;
+
+    x0 = MAX(cells->x - g->x, 0);
+    y0 = MAX(cells->y - g->y, 0);
+    x1 = MIN(cells->x - g->x + cells->width, g->width);
+    y1 = MIN(cells->y - g->y + cells->height, g->height);
+
+    for (int i = y0; i < y1; i++)
+        for (int j = x0; j < x1; j++)
+            g->cells[i * g->width + j] += delta;
+}
+
+static void
+place_rects_dirty(int ws)
+{
+    if (ws >= 0 && ws < ws_count)
+        p_rects[ws].dirty = true;
+}
+
+static bool
+place_rects_push(struct place_rects *pr, struct client_geom r)
+{
+    if (pr->count == pr->size) {
+        int size = pr->size == 0 ? WIN_INDEX_INITIAL : pr->size * 2;
+        struct client_geom *tmp = realloc(pr->rects, size * sizeof(*tmp));
+        if (tmp == NULL)
+            return false;
+        pr->rects = tmp;
+        pr->size = size;
+    }
+    pr->rects[pr->count++] = r;
+    return true;
+}
+
+/* Carve used out of every free rectangle it overlaps, replacing each of
+ * them by the up to four maximal rectangles around used.
+ */
+static void
+place_rects_split(struct place_rects *pr, struct client_geom *used)
+{
+    int n = pr->count;
+
+    for (int i = 0; i < n; i++) {
+        struct client_geom f = pr->rects[i];
+
+        if (used->x >= f.x + f.width || used->x + used->width <= f.x ||
+            used->y >= f.y + f.height || used->y + used->height <= f.y)
+            continue;
+
+        if (used->x > f.x)
+            place_rects_push(pr, (struct client_geom) { f.x, f.y, used->x - f.x, f.height });
+        if (used->x + used->width < f.x + f.width)
+            place_rects_push(pr, (struct client_geom) { used->x + used->width, f.y,
+                    f.x + f.width - used->x - used->width, f.height });
+        if (used->y > f.y)
+            place_rects_push(pr, (struct client_geom) { f.x, f.y, f.width, used->y - f.y });
+        if (used->y + used->height < f.y + f.height)
+            place_rects_push(pr, (struct client_geom) { f.x, used->y + used->height,
+                    f.width, f.y + f.height - used->y - used->height });
+
+        /* Mark the split rectangle for removal */
+        pr->rects[i].width = 0;
+    }
+
+    place_rects_prune(pr);
+}
+
+/* Drop split rectangles and those contained in another */
+static void
+place_rects_prune(struct place_rects *pr)
+{
+    int n = 0;
+
+    for (int i = 0; i < pr->count; i++) {
+        struct client_geom *a = &pr->rects[i];
+        bool keep = a->width > 0 && a->height > 0;
+
+        for (int j = 0; j < pr->count && keep; j++) {
+            struct client_geom *b = &pr->rects[j];
+            if (i == j || b->width <= 0)
+                continue;
+            if (a->x >= b->x && a->y >= b->y &&
+                a->x + a->width <= b->x + b->width && a->y + a->height <= b->y + b->height) {
+                /* Of two equal rectangles keep the first */
+                bool equal = a->x == b->x && a->y == b->y && a->width == b->width && a->height == b->height;
+                keep = equal && i < j;
+            }
+        }
+
+        if (keep)
+            pr->rects[n++] = *a;
+        else
+            a->width = 0;
+    }
+    pr->count = n;
+}
+
+/* Rebuild the free rectangles of c's workspace, leaving c itself out,
+ * unless nothing changed since they were last built.
+ */
+static bool
+place_rects_sync(struct client *c, struct client_geom *area)
+{
+    struct place_rects *pr = &p_rects[c->ws];
+
+    if (!pr->dirty && pr->skip == c && pr->area.x == area->x && pr->area.y == area->y &&
+        pr->area.width == area->width && pr->area.height == area->height)
+        return true;
+
+    pr->count = 0;
+    pr->area = *area;
+    pr->skip = c;
+    pr->dirty = false;
+    if (area->width <= 0 || area->height <= 0 || !place_rects_push(pr, *area))
+        return false;
+
+    for (struct client *tmp = c_list[c->ws]; tmp != NULL; tmp = tmp->next)
+        if (tmp != c)
+            place_rects_split(pr, &tmp->geom);
+
+    LOGP("Workspace %d has %d free rectangles", c->ws, pr->count);
+    return true;
+}
+
+/* Area of other windows on c's workspace that c would cover at x, y */
+static int
+place_overlap(struct client *c, int x, int y)
+{
+    int total = 0;
+
+    for (struct client *tmp = c_list[c->ws]; tmp != NULL; tmp = tmp->next) {
+        if (tmp == c)
+            continue;
+        int w = MIN(x + c->geom.width, tmp->geom.x + tmp->geom.width) - MAX(x, tmp->geom.x);
+        int h = MIN(y + c->geom.height, tmp->geom.y + tmp->geom.height) - MAX(y, tmp->geom.y);
+        if (w > 0 && h > 0)
+            total += w * h;
+    }
+    return total;
+}
+
+/* Place the client in one of the maximal free rectangles of its monitor */
+static void
+client_place_rects(struct client *c)
+{
+    struct client_geom area, *best = NULL;
+    struct place_rects *pr = &p_rects[c->ws];
+    int mon = ws_m_list[c->ws];
+    long best_score = LONG_MAX;
+
+    area.x = m_list[mon].x + conf.left_gap;
+    area.y = m_list[mon].y + conf.top_gap;
+    area.width = m_list[mon].width - conf.left_gap - conf.right_gap;
+    area.height = m_list[mon].height - conf.top_gap - conf.bot_gap;
+
+    if (!place_rects_sync(c, &area)) {
+        client_center(c);
+        return;
+    }
+
+    for (int i = 0; i < pr->count; i++) {
+        struct client_geom *r = &pr->rects[i];
+        long score;
+
+        if (r->width < c->geom.width || r->height < c->geom.height)
+            continue;
+
+        if (conf.smart_place == PlaceFirst)
+            score = (long)r->y * area.width + r->x;
+        else
+            score = MIN(r->width - c->geom.width, r->height - c->geom.height);
+
+        if (score < best_score) {
+            best_score = score;
+            best = r;
+        }
+    }
+
+    if (best != NULL) {
+        client_move_absolute(c, best->x, best->y);
+        return;
+    }
+
+    if (conf.smart_place != PlaceOverlap) {
+        client_center(c);
+        return;
+    }
+
+    /* Nothing is free, try the corners of every free rectangle and the
+     * edges of every window for the spot hiding the least */
+    int best_x = area.x, best_y = area.y;
+    int max_x = MAX(area.x + area.width - c->geom.width, area.x);
+    int max_y = MAX(area.y + area.height - c->geom.height, area.y);
+    best_score = place_overlap(c, best_x, best_y);
+
+    for (struct client *tmp = c_list[c->ws]; tmp != NULL; tmp = tmp->next) {
+        int xs[] = { tmp->geom.x + tmp->geom.width, tmp->geom.x, tmp->geom.x - c->geom.width };
+        int ys[] = { tmp->geom.y + tmp->geom.height, tmp->geom.y, tmp->geom.y - c->geom.height };
+
+        if (tmp == c)
+            continue;
+
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                int x = MIN(MAX(xs[i], area.x), max_x);
+                int y = MIN(MAX(ys[j], area.y), max_y);
+                long score = place_overlap(c, x, y);
+                if (score < best_score) {
+                    best_score = score;
+                    best_x = x;
+                    best_y = y;
+                }
+            }
+        }
+    }
+
+    client_move_absolute(c, best_x, best_y);
+}
+
+/* Take a client that leaves its workspace out of the placement grid */
+static void
+place_grid_forget(struct client *c)
+{
+    if (p_grid[c->ws].cells != NULL)
+        place_grid_mark(&p_grid[c->ws], &c->p_cells, -1);
+    c->p_cells.width = 0;
+}
+
 static void
 client_place(struct client *c)
+{
+    // If this is the first window in the workspace, we can simply center
+    // it. Also center it if the user wants to disable smart placement.
+    if (f_list[curr_ws]->next == NULL || conf.smart_place == PlaceCenter) {
+        client_center(c);
+        return;
+    }
+
+    if (conf.smart_place == PlaceGrid)
+        client_place_grid(c);
+    else
+        client_place_rects(c);
+}
+
+/* Find room for the client on its monitor, preferring the lowest row
+ * and then the leftmost column that fits. Free runs are counted a row
+ * at a time from the top, so only one row of them is ever kept.
+ */
+static void
+client_place_grid(struct client *c)
 {
     int width, height, mon, count, max_height, t_gap, b_gap, l_gap, r_gap, x_off, y_off;
 
@@ -1561,91 +3968,51 @@ client_place(struct client *c)
     x_off = m_list[mon].x / PLACE_RES;
     y_off = m_list[mon].y / PLACE_RES;
 
-    // If this is the first window in the workspace, we can simply center
-    // it. Also center it if the user wants to disable smart placement.
-    if (f_list[curr_ws]->next == NULL || !conf.smart_place) {
+    if (!place_grid_sync(c, mon)) {
         client_center(c);
         return;
     }
 
-    uint16_t opt[height][width];
-
-    // Initialize array to all 1's
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            opt[i][j] = 1;
-        }
-    }
-
-    for (struct client *tmp = f_list[curr_ws]; tmp != NULL; tmp = tmp->next) {
-        if (tmp != c) {
-            struct client_geom *geom = &tmp->geom;
-            for (int i = geom->y / PLACE_RES;
-                 i < (geom->y / PLACE_RES) + (geom->height / PLACE_RES) && i < height + y_off;
-                 i++) {
-                for (int j = geom->x / PLACE_RES;
-                     j < (geom->x / PLACE_RES) + (geom->width / PLACE_RES) && j < width + x_off;
-                     j++) {
-                    opt[i-y_off][j-x_off] = 0;
-                }
-            }
-        }
-    }
-
-    /* NOTE: can we factor these for-loops.
-     *       something something spatial locality?...
-     */
+    struct place_grid *g = &p_grid[c->ws];
+    int need_w = c->geom.width / PLACE_RES, need_h = c->geom.height / PLACE_RES;
+    int best_i = -1, best_j = 0, best_count = 0, best_height = 0;
 
-    for (int i = 0; i < t_gap; i++) { // top gap
-        for (int j = 0; j < width; j++) {
-            opt[i][j] = 0;
-        }
-    }
+    memset(g->run, 0, width * sizeof(*g->run));
+    for (int i = 0; i < height - b_gap; i++) {
+        bool found = false;
 
-    for (int i = height - b_gap; i < height; i++) {
         for (int j = 0; j < width; j++) {
-            opt[i][j] = 0;
-        }
-    }
-
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < l_gap; j++) {
-            opt[i][j] = 0;
-        }
-    }
-
-    for (int i = 0; i < height; i++) {
-        for (int j = width; j < width - r_gap; j++) {
-            opt[i][j] = 0;
+            bool free_cell = i >= t_gap && j >= l_gap && g->cells[i * width + j] == 0;
+            g->run[j] = free_cell ? g->run[j] + 1 : 0;
         }
-    }
 
-    // fill in the OPT matrix
-    for (int i = 1; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            opt[i][j] = opt[i][j] == 0 ? 0 : opt[i-1][j] + 1;
-        }
-    }
+        if (i < need_h)
+            continue;
 
-    count = 0;
-    max_height = INT_MAX;
-    for (int i = height - b_gap - 1; i >= c->geom.height / PLACE_RES; i--) {
-        for (int j = l_gap; j < width - r_gap; j++) {
-            while (j < width && opt[i][j] >= c->geom.height / PLACE_RES) {
-                max_height = MIN(max_height, opt[i][j]);
+        for (int j = l_gap; j < width - r_gap && !found; j++) {
+            count = 0;
+            max_height = INT_MAX;
+            while (j < width - r_gap && g->run[j] >= need_h) {
+                max_height = MIN(max_height, g->run[j]);
                 count++;
                 j++;
             }
             // the window WILL fit here
-            if (count >= c->geom.width / PLACE_RES) {
-                int place_x = x_off * PLACE_RES + MAX(conf.left_gap, ceil10((j - count) * PLACE_RES + (count * PLACE_RES - c->geom.width) / 2));
-                int place_y = y_off * PLACE_RES + MAX(conf.top_gap, ceil10((i - max_height + 1) * PLACE_RES + (max_height * PLACE_RES - c->geom.height) / 2));
-                client_move_absolute(c, place_x, place_y);
-                return;
+            if (count >= need_w && count > 0) {
+                best_i = i;
+                best_j = j - count;
+                best_count = count;
+                best_height = max_height;
+                found = true;
             }
-            count = 0;
         }
     }
+
+    if (best_i >= 0) {
+        int place_x = x_off * PLACE_RES + MAX(conf.left_gap, ceil10(best_j * PLACE_RES + (best_count * PLACE_RES - c->geom.width) / 2));
+        int place_y = y_off * PLACE_RES + MAX(conf.top_gap, ceil10((best_i - best_height + 1) * PLACE_RES + (best_height * PLACE_RES - c->geom.height) / 2));
+        client_move_absolute(c, place_x, place_y);
+    }
 }
 
 static void
@@ -1655,34 +4022,23 @@ client_raise(struct client *c)
         if (!c->decorated) {
             XRaiseWindow(display, c->window);
         } else {
-            // how may active clients are there on our workspace
-            int count, i;
-            count = 0;
-            for (struct client *tmp = c_list[c->ws]; tmp != NULL; tmp = tmp->next) {
-                count++;
-            }
-
-            if (count == 0)
-                return;
-
-            Window wins[count*2];
-
-            i = 0;
-            for (struct client *tmp = c_list[c->ws]; tmp != NULL; tmp = tmp->next) {
-                wins[i] = tmp->window;
-                wins[i+1] = tmp->dec;
-                i += 2;
-            }
-            XRestackWindows(display, wins, count*2);
+            ws_restack(c->ws);
         }
     }
 }
 
-static void monitors_setup(void)
+/* Read the monitors from Xinerama. This runs at startup and again
+ * whenever XRandR reports a change, so m_list is only replaced and
+ * clients only moved if some monitor really is different.
+ */
+static void
+monitors_setup(void)
 {
     XineramaScreenInfo *m_info;
-    int n;
+    struct monitor *old;
+    int n, old_count;
 
+    monitors_dirty = false;
     if (!XineramaIsActive(display)) {
         LOGN("Xinerama not active, cannot read monitors");
         return;
@@ -1694,7 +4050,20 @@ static void monitors_setup(void)
         return;
     }
     LOGP("Found %d screens active", n);
-    m_count = n;
+
+    if (n == m_count) {
+        int i;
+        for (i = 0; i < n; i++)
+            if (m_list[i].screen != m_info[i].screen_number ||
+                    m_list[i].x != m_info[i].x_org || m_list[i].y != m_info[i].y_org ||
+                    m_list[i].width != m_info[i].width || m_list[i].height != m_info[i].height)
+                break;
+        if (i == n) {
+            LOGN("Monitors are unchanged");
+            XFree(m_info);
+            return;
+        }
+    }
 
     /* First, we need to decide which monitors are unique.
      * Non-unique monitors can become a problem when displays
@@ -1706,7 +4075,15 @@ static void monitors_setup(void)
 
     // TODO: Add support for repeated displays
 
+    old = m_list;
+    old_count = m_count;
     m_list = malloc(sizeof(struct monitor) * n);
+    if (m_list == NULL) {
+        m_list = old;
+        XFree(m_info);
+        return;
+    }
+    m_count = n;
 
     for (int i = 0; i < n; i++) {
         m_list[i].screen = m_info[i].screen_number;
@@ -1717,32 +4094,237 @@ static void monitors_setup(void)
         LOGP("Screen #%d with dim: x=%d y=%d w=%d h=%d",
                 m_list[i].screen, m_list[i].x, m_list[i].y, m_list[i].width, m_list[i].height);
     }
+    XFree(m_info);
+
+    /* Workspaces follow their monitor, or fall back to the first one if
+     * it went away */
+    for (int i = 0; i < ws_count && old != NULL; i++) {
+        int prev = ws_m_list[i];
+        if (ws_m_list[i] >= m_count)
+            ws_m_list[i] = 0;
+        if (prev >= old_count)
+            continue;
+
+        struct monitor *from = &old[prev], *to = &m_list[ws_m_list[i]];
+        if (from->x == to->x && from->y == to->y && from->width == to->width && from->height == to->height)
+            continue;
+
+        LOGP("Monitor of workspace %d changed, moving its clients", i);
+        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next)
+            monitors_shift_client(tmp, to->x - from->x, to->y - from->y);
+    }
+    free(old);
+    shm_dirty = true;
+
+    monitors_rate();
 
     ewmh_set_viewport();
 }
 
+/* Whether any part of the rectangle is on one of the monitors */
+static bool
+monitors_overlap(int x, int y, int w, int h)
+{
+    for (int i = 0; i < m_count; i++)
+        if (x < m_list[i].x + m_list[i].width && x + w > m_list[i].x &&
+                y < m_list[i].y + m_list[i].height && y + h > m_list[i].y)
+            return true;
+    return false;
+}
+
+/* Carry a client along with its monitor and fit it to the new size */
+static void
+monitors_shift_client(struct client *c, int dx, int dy)
+{
+    int mon = ws_m_list[c->ws];
+
+    if (c->hidden) {
+        /* Stays off screen, shown again at its new place */
+        c->x_hide += dx;
+        client_move_absolute(c, c->geom.x, c->geom.y + dy);
+    } else if (c->fullscreen && conf.fs_max) {
+        client_move_absolute(c, m_list[mon].x, m_list[mon].y);
+        client_resize_absolute(c, m_list[mon].width, m_list[mon].height);
+    } else {
+        client_move_absolute(c, c->geom.x + dx, c->geom.y + dy);
+        client_refresh(c);
+    }
+}
+
+/* Settle the client back inside its monitor. Locking the size can undo
+ * the position lock and the other way around, so both are applied twice
+ * on a scratch copy and only the result is sent.
+ */
 static void
 client_refresh(struct client *c)
 {
+    struct client_geom g = c->geom;
+
     LOGN("Refreshing client");
     for (int i = 0; i < 2; i++) {
-        client_move_relative(c, 0, 0);
-        client_resize_relative(c, 0, 0);
+        client_lock_move(c, &g, 0, 0);
+        client_lock_resize(c, &g, 0, 0);
     }
+
+    c->geom = g;
+    ws_index_update(c);
+    client_configure_windows(c);
+    if (c->mono)
+        c->mono = false;
+    client_set_status(c);
 }
 
+/* Ask XRandR for the refresh rate, which paces adaptive drags */
 static void
-refresh_config(void)
+monitors_rate(void)
 {
-    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
-        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
+    XRRScreenConfiguration *sc;
+    int event_base, error_base;
+    short rate = 0;
+
+    if (XRRQueryExtension(display, &event_base, &error_base)) {
+        sc = XRRGetScreenInfo(display, root);
+        if (sc != NULL) {
+            rate = XRRConfigCurrentRate(sc);
+            XRRFreeScreenConfigInfo(sc);
+        }
+    }
+
+    if (rate <= 0)
+        rate = DEFAULT_REFRESH_RATE;
+    frame_ms = MAX(1000 / rate, 1);
+    LOGP("Refresh rate %d, pacing drags every %dms", rate, frame_ms);
+}
+
+/* Find out whether the client implements _NET_WM_SYNC_REQUEST and, if it
+ * does, set up an alarm that fires once it has handled each request.
+ */
+static void
+client_sync_setup(struct client *c)
+{
+    XSyncAlarmAttributes attr;
+
+    if (!sync_supported || !(client_protocols(c) & ProtoSyncRequest)) {
+        c->sync_counter = None;
+        return;
+    }
+
+    if (c->sync_counter == None)
+        return;
+
+    /* Requests carry on from wherever the client's counter is */
+    if (!XSyncQueryCounter(display, c->sync_counter, &c->sync_value))
+        XSyncIntToValue(&c->sync_value, 0);
+
+    attr.trigger.counter = c->sync_counter;
+    attr.trigger.value_type = XSyncAbsolute;
+    attr.trigger.test_type = XSyncPositiveComparison;
+    attr.trigger.wait_value = c->sync_value;
+    XSyncIntToValue(&attr.delta, 0);
+    attr.events = True;
+    c->sync_alarm = XSyncCreateAlarm(display,
+            XSyncCACounter | XSyncCAValueType | XSyncCATestType | XSyncCAValue | XSyncCADelta | XSyncCAEvents,
+            &attr);
+    LOGP("Client 0x%lx supports sync requests", c->window);
+}
+
+static void
+client_sync_free(struct client *c)
+{
+    if (c->sync_alarm != None)
+        XSyncDestroyAlarm(display, c->sync_alarm);
+    c->sync_alarm = None;
+    c->sync_counter = None;
+}
+
+/* Ask the client to bump its counter once it has drawn the configure
+ * that follows. Returns false if the client doesn't take part.
+ */
+static bool
+client_sync_request(struct client *c, Time t)
+{
+    XSyncAlarmAttributes attr;
+    XSyncValue one;
+    XEvent ev;
+    Bool overflow;
+
+    if (c->sync_alarm == None)
+        return false;
+
+    XSyncIntToValue(&one, 1);
+    XSyncValueAdd(&c->sync_value, c->sync_value, one, &overflow);
+    attr.trigger.wait_value = c->sync_value;
+    XSyncChangeAlarm(display, c->sync_alarm, XSyncCAValue, &attr);
+
+    memset(&ev, 0, sizeof ev);
+    ev.type = ClientMessage;
+    ev.xclient.window = c->window;
+    ev.xclient.message_type = wm_atom[WMProtocols];
+    ev.xclient.format = 32;
+    ev.xclient.data.l[0] = net_atom[NetWMSyncRequest];
+    ev.xclient.data.l[1] = t;
+    ev.xclient.data.l[2] = XSyncValueLow32(c->sync_value);
+    ev.xclient.data.l[3] = XSyncValueHigh32(c->sync_value);
+    XSendEvent(display, c->window, False, NoEventMask, &ev);
+
+    c->sync_time = t;
+    c->sync_wait = true;
+    return true;
+}
+
+/* Returns true if the event is the client's alarm reporting it caught up */
+static bool
+client_sync_alarm(struct client *c, XEvent *e)
+{
+    XSyncAlarmNotifyEvent *ev = (XSyncAlarmNotifyEvent *)e;
+
+    if (!sync_supported || e->type != sync_event_base + XSyncAlarmNotify)
+        return false;
+    if (c == NULL || c->sync_alarm == None || ev->alarm != c->sync_alarm)
+        return false;
+
+    if (XSyncValueGreaterOrEqual(ev->counter_value, c->sync_value))
+        c->sync_wait = false;
+    return true;
+}
+
+/* Events from extensions, which don't fit in event_handler */
+static void
+handle_extension_event(XEvent *e)
+{
+    if (randr_supported && (e->type == randr_event_base + RRScreenChangeNotify ||
+                e->type == randr_event_base + RRNotify)) {
+        /* Several of these come at once, batch_flush reads the monitors once */
+        if (e->type == randr_event_base + RRScreenChangeNotify)
+            XRRUpdateConfiguration(e);
+        monitors_dirty = true;
+        return;
+    }
+
+    if (sync_supported && e->type == sync_event_base + XSyncAlarmNotify) {
+        /* An answer that came in after the drag ended */
+        for (int i = 0; i < ws_used_count; i++)
+            for (struct client *tmp = c_list[ws_used[i]]; tmp != NULL; tmp = tmp->next)
+                if (client_sync_alarm(tmp, e))
+                    return;
+    }
+}
+
+/* Fit every client to the current config, recreating the decorations
+ * too if rebuild is set */
+static void
+refresh_config(bool rebuild)
+{
+    for (int i = 0; i < ws_used_count; i++) {
+        int ws = ws_used[i];
+        for (struct client *tmp = c_list[ws]; tmp != NULL; tmp = tmp->next) {
             /* We run into this annoying issue when where we have to
              * re-create these windows since the border_width has changed.
              * We end up destroying and recreating this windows, but this
              * causes them to be redrawn on the wrong screen, regardless of
              * their current desktop. The easiest way around this is to move
              * them all to the current desktop and then back agian */
-            if (tmp->decorated && conf.decorate) {
+            if (rebuild && tmp->decorated && conf.decorate) {
                 client_decorations_destroy(tmp);
                 client_decorations_create(tmp);
                 XMapWindow(display, tmp->dec);
@@ -1756,7 +4338,7 @@ refresh_config(void)
             else
                 client_set_color(tmp, conf.if_color, conf.bf_color);
 
-            if (i != curr_ws) {
+            if (ws != curr_ws) {
                 client_hide(tmp);
             } else {
                 client_show(tmp);
@@ -1766,93 +4348,472 @@ refresh_config(void)
     }
 }
 
+/* Paint every decoration again in the current colors and font. Unlike
+ * refresh_config nothing is recreated or moved. */
+static void
+repaint_config(void)
+{
+    for (int i = 0; i < ws_used_count; i++) {
+        for (struct client *tmp = c_list[ws_used[i]]; tmp != NULL; tmp = tmp->next) {
+            if (f_client != tmp)
+                client_set_color(tmp, conf.iu_color, conf.bu_color);
+            else
+                client_set_color(tmp, conf.if_color, conf.bf_color);
+        }
+    }
+}
+
+static void
+client_resize_absolute(struct client *c, int w, int h)
+{
+    c->geom.width = MAX(w, MINIMUM_DIM);
+    c->geom.height = MAX(h, MINIMUM_DIM);
+    client_configure_windows(c);
+    if (c->mono)
+        c->mono = false;
+    client_set_status(c);
+}
+
+static void
+client_resize_relative(struct client *c, int w, int h)
+{
+    struct client_geom g = c->geom;
+
+    client_lock_resize(c, &g, w, h);
+    client_resize_absolute(c, g.width, g.height);
+}
+
+/* Work out the size growing g by w, h ends up with */
+static void
+client_lock_resize(struct client *c, struct client_geom *g, int w, int h)
+{
+    int dw, dh;
+
+    if (conf.edge_lock) {
+        int mon;
+        mon = ws_m_list[c->ws];
+
+        /* First, check if the resize will exceed the dimensions set by
+         * the right side of the given monitor. If they do, cap the resize
+         * amount to move only to the edge of the monitor.
+         */
+        if (g->x + g->width + w > m_list[mon].x + m_list[mon].width - conf.right_gap)
+            dw = m_list[mon].x + m_list[mon].width - g->x - conf.right_gap;
+        else
+            dw = g->width + w;
+
+        /* Next, check if the resize will exceed the dimensions set by
+         * the bottom side of the given monitor. If they do, cap the resize
+         * amount to move only to the edge of the monitor.
+         */
+        if (g->y + g->height + conf.t_height + h > m_list[mon].y + m_list[mon].height - conf.bot_gap)
+            dh = m_list[mon].height + m_list[mon].y - g->y - conf.bot_gap;
+        else
+            dh = g->height + h;
+    } else {
+        dw = g->width + w;
+        dh = g->height + h;
+    }
+
+    g->width = MAX(dw, MINIMUM_DIM);
+    g->height = MAX(dh, MINIMUM_DIM);
+}
+
+/* Try to fold the given event into one already sitting in the first n
+ * slots of the batch. Superseded events are zeroed out rather than removed
+ * so that the surviving events keep their relative order. Returns true if
+ * the given event was absorbed and should not be queued itself.
+ */
+static bool
+event_coalesce(int n, XEvent *e)
+{
+    for (int i = n - 1; i >= 0; i--) {
+        XEvent *prev = &ev_batch[i];
+
+        if (prev->type != e->type)
+            continue;
+
+        switch (e->type) {
+            case PropertyNotify:
+                /* Only the latest value of a property is worth reading */
+                if (prev->xproperty.window == e->xproperty.window &&
+                    prev->xproperty.atom == e->xproperty.atom) {
+                    prev->type = 0;
+                    return false;
+                }
+                break;
+            case ConfigureNotify:
+                if (prev->xconfigure.window == e->xconfigure.window) {
+                    prev->type = 0;
+                    return false;
+                }
+                break;
+            case Expose:
+                /* Grow the earlier damage rectangle to cover both */
+                if (prev->xexpose.window == e->xexpose.window) {
+                    XExposeEvent *a = &prev->xexpose, *b = &e->xexpose;
+                    int x2 = MAX(a->x + a->width, b->x + b->width);
+                    int y2 = MAX(a->y + a->height, b->y + b->height);
+                    a->x = MIN(a->x, b->x);
+                    a->y = MIN(a->y, b->y);
+                    a->width = x2 - a->x;
+                    a->height = y2 - a->y;
+                    a->count = 0;
+                    return true;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return false;
+}
+
+static void
+run(void)
+{
+    XEvent e;
+    int n, total, merged;
+    XSync(display, false);
+    while (running) {
+        /* Nothing queued from the X server, sleep until either it or one
+         * of the control socket clients has something for us.
+         */
+        if (XPending(display) == 0) {
+            ipc_wait(true);
+#if LOG_LEVEL >= LOG_TRACE
+            if (trace_pending) {
+                struct strbuf sb = { 0 };
+                trace_pending = 0;
+                trace_dump(&sb);
+                if (sb.len > 0)
+                    fwrite(sb.buf, 1, sb.len, stderr);
+                sb_free(&sb);
+            }
+#endif
+            batch_flush();
+            continue;
+        }
+
+        XNextEvent(display, &e);
+        n = merged = 0;
+        total = 1;
+        ev_batch[n++] = e;
+
+        /* Drain whatever else is already queued so that storms of the same
+         * event collapse into one handler call. Stop after a button press,
+         * its handler grabs the pointer and reads the queue itself.
+         */
+        while (n < EVENT_BATCH_MAX && e.type != ButtonPress && XPending(display)) {
+            XNextEvent(display, &e);
+            total++;
+            if (event_coalesce(n, &e))
+                merged++;
+            else
+                ev_batch[n++] = e;
+        }
+
+        for (int i = 0; i < n; i++)
+            if (ev_batch[i].type == 0)
+                merged++;
+
+        if (merged > 0)
+            LOGP("Coalesced %d of %d queued events", merged, total);
+
+        for (int i = 0; i < n && running; i++) {
+            XEvent *ev = &ev_batch[i];
+            if (ev->type == 0)
+                continue;
+            LOGT(ev->type, ev->xany.window);
+            uint64_t start = now_usec();
+            unsigned long request = NextRequest(display);
+            if (ev->type >= LASTEvent) {
+                handle_extension_event(ev);
+            } else if (event_handler[ev->type]) {
+                event_handler[ev->type](ev);
+            }
+            stats_add(&stats_event[MIN(ev->type, LASTEvent)], start, request);
+        }
+
+        /* Keep serving berryc through a storm of X events */
+        ipc_wait(false);
+        batch_flush();
+    }
+}
+
+/* Publish any state whose updates were deferred while handling a batch */
+static void
+batch_flush(void)
+{
+    focus_pending_commit();
+    config_pending_commit();
+    if (monitors_dirty)
+        monitors_setup();
+    ewmh_flush_client_list();
+    status_flush();
+    shm_status_flush();
+    ipc_events_flush();
+}
+
+static void
+ipc_socket_setup(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    for (int i = 0; i < IPC_MAX_CONN; i++)
+        ipc_conns[i].fd = -1;
+
+    if (ipc_socket_path(ipc_path, sizeof(ipc_path)) < 0 || strlen(ipc_path) >= sizeof(addr.sun_path)) {
+        LOGN("Control socket path is too long, using X messages only");
+        ipc_path[0] = '\0';
+        return;
+    }
+    strcpy(addr.sun_path, ipc_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return;
+
+    /* A socket left behind by a berry that died can be reused, one that
+     * still answers belongs to someone else.
+     */
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        LOGP("Control socket %s is in use, using X messages only", ipc_path);
+        close(fd);
+        ipc_path[0] = '\0';
+        return;
+    }
+    unlink(ipc_path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, IPC_MAX_CONN) < 0) {
+        LOGP("Could not listen on %s, using X messages only", ipc_path);
+        close(fd);
+        ipc_path[0] = '\0';
+        return;
+    }
+
+    chmod(ipc_path, S_IRUSR | S_IWUSR);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    ipc_fd = fd;
+    LOGP("Listening on %s", ipc_path);
+}
+
+static void
+ipc_socket_close(void)
+{
+    for (int i = 0; i < IPC_MAX_CONN; i++)
+        if (ipc_conns[i].fd >= 0)
+            ipc_conn_close(&ipc_conns[i]);
+
+    if (ipc_fd >= 0) {
+        close(ipc_fd);
+        unlink(ipc_path);
+        ipc_fd = -1;
+    }
+    sb_free(&ipc_out);
+}
+
+/* Block until the X connection or a control socket client is ready,
+ * serving the socket clients on the way out. Without block only the
+ * clients that are ready already are served.
+ */
 static void
-client_resize_absolute(struct client *c, int w, int h)
+ipc_wait(bool block)
 {
-    int dw = w;
-    int dh = h;
-    int dec_w = w;
-    int dec_h = h;
+    struct pollfd fds[IPC_MAX_CONN + 2];
+    struct ipc_conn *conns[IPC_MAX_CONN];
+    int n = 0, base, timeout, config_timeout;
+
+    fds[n++] = (struct pollfd) { .fd = ConnectionNumber(display), .events = POLLIN };
+    fds[n++] = (struct pollfd) { .fd = ipc_fd, .events = POLLIN };
+    base = n;
+
+    for (int i = 0; i < IPC_MAX_CONN; i++) {
+        struct ipc_conn *conn = &ipc_conns[i];
+        if (conn->fd < 0)
+            continue;
+        conns[n - base] = conn;
+        fds[n++] = (struct pollfd) { .fd = conn->fd, .events = conn->out.len > 0 ? POLLIN | POLLOUT : POLLIN };
+    }
 
-    if (c->decorated) {
-        dw = w - (2 * conf.i_width) - (2 * conf.b_width);
-        dh = h - (2 * conf.i_width) - (2 * conf.b_width) - conf.t_height;
+    /* poll skips the listener slot while ipc_fd is negative */
+    XFlush(display);
+    timeout = block ? focus_pending_timeout() : 0;
+    config_timeout = block ? config_pending_timeout() : -1;
+    if (config_timeout >= 0 && (timeout < 0 || config_timeout < timeout))
+        timeout = config_timeout;
+    if (poll(fds, n, timeout) <= 0)
+        return;
 
-        dec_w = w - (2 * conf.b_width);
-        dec_h = h - (2 * conf.b_width);
+    for (int i = base; i < n; i++) {
+        struct ipc_conn *conn = conns[i - base];
+        if (fds[i].revents & POLLOUT)
+            ipc_conn_write(conn);
+        if (conn->fd >= 0 && fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            ipc_conn_read(conn);
     }
 
-    /*LOGN("Resizing client main window");*/
-    XResizeWindow(display, c->window, MAX(dw, MINIMUM_DIM), MAX(dh, MINIMUM_DIM));
-    if (c->decorated) {
-        /*LOGN("Resizing client decoration");*/
-        XResizeWindow(display, c->dec, MAX(dec_w, MINIMUM_DIM), MAX(dec_h, MINIMUM_DIM));
+    if (fds[1].revents & POLLIN)
+        ipc_conn_accept();
+}
+
+static void
+ipc_conn_accept(void)
+{
+    int fd;
+
+    while ((fd = accept(ipc_fd, NULL, NULL)) >= 0) {
+        struct ipc_conn *conn = NULL;
+
+        for (int i = 0; i < IPC_MAX_CONN && conn == NULL; i++)
+            if (ipc_conns[i].fd < 0)
+                conn = &ipc_conns[i];
+
+        if (conn == NULL) {
+            LOGN("Too many control connections, refusing");
+            close(fd);
+            continue;
+        }
+
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        conn->fd = fd;
+        conn->in.len = conn->out.len = 0;
+        conn->events = 0;
+        conn->dropped = 0;
+        LOGP("Accepted control connection %d", fd);
     }
+}
 
-    c->geom.width = MAX(w, MINIMUM_DIM);
-    c->geom.height = MAX(h, MINIMUM_DIM);
-    if (c->mono)
-        c->mono = false;
-    client_set_status(c);
+static void
+ipc_conn_close(struct ipc_conn *conn)
+{
+    LOGP("Closing control connection %d", conn->fd);
+    close(conn->fd);
+    conn->fd = -1;
+    sb_free(&conn->in);
+    sb_free(&conn->out);
+    if (conn->events != 0) {
+        conn->events = 0;
+        ipc_event_mask_update();
+    }
 }
 
+/* Read what the client has sent and run every complete request in it.
+ * The requests of one read are handled as a batch, so a burst of
+ * configuration changes is applied to the clients together.
+ */
 static void
-client_resize_relative(struct client *c, int w, int h)
+ipc_conn_read(struct ipc_conn *conn)
 {
-    if (conf.edge_lock) {
-        int dw, dh, mon;
-        mon = ws_m_list[c->ws];
+    char buf[IPC_MAX_PAYLOAD + 1];
+    struct ipc_request req;
+    struct ipc_reply rep;
+    size_t off = 0;
+    ssize_t r;
+    bool eof;
+
+    while ((r = recv(conn->fd, buf, sizeof(buf), 0)) > 0) {
+        if (sb_append(&conn->in, buf, r) < 0 || conn->in.len > IPC_MAX_BUFFER) {
+            ipc_conn_close(conn);
+            return;
+        }
+    }
 
-        /* First, check if the resize will exceed the dimensions set by
-         * the right side of the given monitor. If they do, cap the resize
-         * amount to move only to the edge of the monitor.
-         */
-        if (c->geom.x + c->geom.width + w > m_list[mon].x + m_list[mon].width - conf.right_gap)
-            dw = m_list[mon].x + m_list[mon].width - c->geom.x - conf.right_gap;
-        else
-            dw = c->geom.width + w;
+    /* Requests sent before a hang up are still answered */
+    eof = r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
 
-        /* Next, check if the resize will exceed the dimensions set by
-         * the bottom side of the given monitor. If they do, cap the resize
-         * amount to move only to the edge of the monitor.
-         */
-        if (c->geom.y + c->geom.height + conf.t_height + h > m_list[mon].y + m_list[mon].height - conf.bot_gap)
-            dh = m_list[mon].height + m_list[mon].y - c->geom.y - conf.bot_gap;
-        else
-            dh = c->geom.height + h;
+    /* A subscriber only listens */
+    if (conn->events != 0) {
+        conn->in.len = 0;
+        if (eof)
+            ipc_conn_close(conn);
+        return;
+    }
 
-        client_resize_absolute(c, dw, dh);
-    } else {
-        client_resize_absolute(c, c->geom.width + w, c->geom.height + h);
+    while (conn->in.len - off >= sizeof(req) && running) {
+        memcpy(&req, conn->in.buf + off, sizeof(req));
+        if (req.size > IPC_MAX_PAYLOAD) {
+            LOGN("Oversized control request, dropping connection");
+            ipc_batch_end();
+            ipc_conn_close(conn);
+            return;
+        }
+        if (conn->in.len - off - sizeof(req) < req.size)
+            break;
+
+        memcpy(buf, conn->in.buf + off + sizeof(req), req.size);
+        buf[req.size] = '\0';
+        off += sizeof(req) + req.size;
+
+        ipc_payload = req.size > 0 ? buf : NULL;
+        ipc_out.len = 0;
+        ipc_status = IPCStatusOk;
+        ipc_conn_current = conn;
+        ipc_dispatch(req.data);
+        ipc_conn_current = NULL;
+        ipc_payload = NULL;
+
+        rep.status = ipc_status;
+        rep.size = ipc_out.len;
+        sb_append(&conn->out, &rep, sizeof(rep));
+        sb_append(&conn->out, ipc_out.buf, ipc_out.len);
+
+        /* Only events follow the reply to a subscription */
+        if (conn->events != 0) {
+            off = conn->in.len;
+            break;
+        }
+    }
+    ipc_batch_end();
+    sb_consume(&conn->in, off);
+
+    if (conn->out.len > IPC_MAX_BUFFER) {
+        LOGN("Control client is not reading replies, dropping connection");
+        ipc_conn_close(conn);
+        return;
     }
+    ipc_conn_write(conn);
+    if (eof && conn->fd >= 0)
+        ipc_conn_close(conn);
 }
 
 static void
-run(void)
+ipc_conn_write(struct ipc_conn *conn)
 {
-    XEvent e;
-    XSync(display, false);
-    while (running) {
-        XNextEvent(display, &e);
-        LOGP("Receieved new %d event", e.type);
-        if (event_handler[e.type]) {
-            LOGP("Handling %d event", e.type);
-            event_handler[e.type](&e);
+    ssize_t r;
+
+    while (conn->out.len > 0) {
+        r = send(conn->fd, conn->out.buf, conn->out.len, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                ipc_conn_close(conn);
+            return;
         }
+        sb_consume(&conn->out, r);
     }
 }
 
 static void
 client_save(struct client *c, int ws)
 {
+    if (c_list[ws] == NULL)
+        ws_used_add(ws);
+
     /* Save the client to the "stack" of managed clients */
-    c->next = c_list[ws];
-    c_list[ws] = c;
+    stack_push(c, ws);
 
     /* Save the client o the list of focusing order */
-    c->f_next = f_list[ws];
-    f_list[ws] = c;
+    focus_push(c, ws);
+    WS_LISTS_CHECK(ws);
 
+    win_index_insert(c->window, c);
+    ws_index_insert(ws, c);
+    place_rects_dirty(ws);
+    client_list_add(c->window);
     ewmh_set_client_list();
 }
 
@@ -1867,9 +4828,11 @@ safe_to_focus(int ws)
     if (m_count == 1)
         return false;
 
-    for (int i = 0; i < WORKSPACE_NUMBER; i++)
-        if (i != ws && ws_m_list[i] == mon && c_list[i] != NULL && c_list[i]->hidden == false)
+    for (int i = 0; i < ws_used_count; i++) {
+        int other = ws_used[i];
+        if (other != ws && ws_m_list[other] == mon && c_list[other]->hidden == false)
             return false;
+    }
 
     LOGN("Workspace is safe to focus");
     return true;
@@ -1879,6 +4842,8 @@ static void
 client_send_to_ws(struct client *c, int ws)
 {
     int prev, mon_next, mon_prev, x_off, y_off;
+    if (ws < 0 || ws >= ws_count)
+        return;
     mon_next = ws_m_list[ws];
     mon_prev = ws_m_list[c->ws];
     client_delete(c);
@@ -1905,7 +4870,11 @@ client_set_color(struct client *c, unsigned long i_color, unsigned long b_color)
     if (c->decorated) {
         XSetWindowBackground(display, c->dec, i_color);
         XSetWindowBorder(display, c->dec, b_color);
-        XClearWindow(display, c->dec);
+        /* The title strip is about to be copied over, only clear below it */
+        if (conf.t_pixmap && conf.draw_text)
+            XClearArea(display, c->dec, 0, conf.t_height, 0, 0, False);
+        else
+            XClearWindow(display, c->dec);
         draw_text(c, c == f_client);
     }
 }
@@ -1921,35 +4890,161 @@ static void
 client_set_title(struct client *c)
 {
     XTextProperty tp;
-    char **slist = NULL;
-    int count;
+    char buf[TITLE_MAX];
+    struct title *t;
 
-    c->title[0] = 0;
+    buf[0] = 0;
     if (!XGetTextProperty(display, c->window, &tp, net_atom[NetWMName])) {
         LOGN("Could not read client title, not updating");
+    } else {
+        title_from_property(buf, sizeof buf, &tp);
+        XFree(tp.value);
+    }
+
+    t = title_intern(buf);
+    if (t == c->title) {
+        /* Same text, the layout and pixmaps still hold */
+        title_release(t);
+        return;
+    }
+
+    title_release(c->title);
+    c->title = t;
+    c->t_valid = false;
+    if (ipc_event_wanted(IPCEventTitle)) {
+        sb_printf(&event_line, "\"window\":\"0x%08lx\",\"title\":", c->window);
+        query_string(&event_line, t->str);
+        ipc_event_send(IPCEventTitle);
+    }
+    c->t_pm_gen[0] = c->t_pm_gen[1] = 0;
+}
+
+/* Find the shared copy of the title, making one if it is new. The empty
+ * title stands in when out of memory. */
+static struct title *
+title_intern(const char *str)
+{
+    unsigned int hash = 2166136261u;
+    size_t len = strlen(str);
+    struct title *t;
+
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+
+    for (t = title_table[hash % TITLE_BUCKETS]; t != NULL; t = t->next) {
+        if (t->hash == hash && t->len == len && memcmp(t->str, str, len) == 0) {
+            t->refs++;
+            return t;
+        }
+    }
+
+    t = malloc(sizeof(struct title) + len + 1);
+    if (t == NULL) {
+        title_none->refs++;
+        return title_none;
+    }
+    t->hash = hash;
+    t->refs = 1;
+    t->len = len;
+    memcpy(t->str, str, len + 1);
+    t->next = title_table[hash % TITLE_BUCKETS];
+    title_table[hash % TITLE_BUCKETS] = t;
+    return t;
+}
+
+static void
+title_release(struct title *t)
+{
+    struct title **p;
+
+    if (t == NULL || --t->refs > 0)
         return;
+
+    for (p = &title_table[t->hash % TITLE_BUCKETS]; *p != NULL; p = &(*p)->next) {
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    }
+    free(t);
+}
+
+/* Clients come out of slabs of CLIENT_SLAB rather than one malloc each,
+ * and go back to client_pool when unmanaged for the next window. They
+ * are handed out zeroed, as a reused one still holds stale pointers. */
+static struct client *
+client_alloc(void)
+{
+    struct client *c;
+
+    if (client_pool == NULL) {
+        struct client_slab *slab = malloc(sizeof(struct client_slab) + CLIENT_SLAB * sizeof(struct client));
+        if (slab == NULL)
+            return NULL;
+        slab->next = client_slabs;
+        client_slabs = slab;
+        for (int i = CLIENT_SLAB - 1; i >= 0; i--) {
+            slab->clients[i].next = client_pool;
+            client_pool = &slab->clients[i];
+        }
     }
 
-    if (tp.encoding == XA_STRING) {
-        strncpy(c->title, (char *)tp.value, sizeof(c->title) - 1);
+    c = client_pool;
+    client_pool = c->next;
+    memset(c, 0, sizeof(struct client));
+    return c;
+}
+
+static void
+client_free(struct client *c)
+{
+    title_release(c->title);
+    c->title = NULL;
+    c->next = client_pool;
+    client_pool = c;
+}
+
+/* Convert a text property to a title of at most size bytes, false if it
+ * came out empty */
+static bool
+title_from_property(char *title, size_t size, XTextProperty *tp)
+{
+    char **slist = NULL;
+    int count;
+    size_t len;
+
+    title[0] = 0;
+    if (tp->encoding == XA_STRING) {
+        /* The value isn't always terminated when it comes from xcb */
+        len = MIN(tp->nitems, size - 1);
+        memcpy(title, tp->value, len);
+        title[len] = 0;
     } else {
-        if (XmbTextPropertyToTextList(display, &tp, &slist, &count) >= Success && count > 0 && *slist) {
-            strncpy(c->title, slist[0], sizeof(c->title) - 1);
+        if (XmbTextPropertyToTextList(display, tp, &slist, &count) >= Success && count > 0 && *slist) {
+            strncpy(title, slist[0], size - 1);
             XFreeStringList(slist);
         }
     }
 
-    c->title[sizeof c->title - 1] = 0;
-    XFree(tp.value);
+    title[size - 1] = 0;
+    return title[0] != 0;
 }
 
 
 static void
 setup(void)
 {
-    unsigned long data[1], data2[1];
+    unsigned long data2[1];
     int mon;
     XSetWindowAttributes wa = { .override_redirect = true };
+
+    if (!ws_grow(WORKSPACE_NUMBER)) {
+        LOGN("Error, could not allocate workspaces");
+        exit(EXIT_FAILURE);
+    }
+    ws_count = WORKSPACE_NUMBER;
+    title_none = title_intern("");
+
     // Setup our conf initially
     conf.b_width          = BORDER_WIDTH;
     conf.t_height         = TITLE_HEIGHT;
@@ -1967,6 +5062,7 @@ setup(void)
     conf.bot_gap          = BOT_GAP;
     conf.smart_place      = SMART_PLACE;
     conf.draw_text        = DRAW_TEXT;
+    conf.t_pixmap         = TITLE_PIXMAP;
     conf.json_status      = JSON_STATUS;
     conf.manage[Dock]     = MANAGE_DOCK;
     conf.manage[Dialog]   = MANAGE_DIALOG;
@@ -1975,14 +5071,25 @@ setup(void)
     conf.manage[Splash]   = MANAGE_SPLASH;
     conf.manage[Utility]  = MANAGE_UTILITY;
     conf.decorate         = DECORATE_NEW;
+    conf.reparent         = REPARENT;
     conf.move_mask        = MOVE_MASK;
     conf.resize_mask      = RESIZE_MASK;
     conf.fs_remove_dec    = FULLSCREEN_REMOVE_DEC;
     conf.fs_max           = FULLSCREEN_MAX;
     conf.pointer_interval = POINTER_INTERVAL;
+    conf.focus_delay      = FOCUS_DELAY;
+    conf.shm_status       = SHM_STATUS;
+    conf.drag_mode        = DRAG_MODE;
     conf.follow_pointer   = FOLLOW_POINTER;
     conf.warp_pointer     = WARP_POINTER;
 
+    int sync_error_base, sync_major, sync_minor, randr_error_base;
+    sync_supported = XSyncQueryExtension(display, &sync_event_base, &sync_error_base) &&
+        XSyncInitialize(display, &sync_major, &sync_minor);
+    LOGP("XSync extension %s", sync_supported ? "available" : "not available");
+    randr_supported = XRRQueryExtension(display, &randr_event_base, &randr_error_base);
+    LOGP("XRandR extension %s", randr_supported ? "available" : "not available");
+
     root = DefaultRootWindow(display);
     screen = DefaultScreen(display);
     display_height = DisplayHeight(display, screen); /* Display height/width still needed for hiding clients */
@@ -1993,6 +5100,8 @@ setup(void)
 
     XSelectInput(display, root,
             StructureNotifyMask|SubstructureRedirectMask|SubstructureNotifyMask|ButtonPressMask|Button1Mask);
+    if (randr_supported)
+        XRRSelectInput(display, root, RRScreenChangeNotifyMask|RRCrtcChangeNotifyMask);
     xerrorxlib = XSetErrorHandler(xerror);
 
     check = XCreateSimpleWindow(display, root, 0, 0, 1, 1, 0, 0, 0);
@@ -2024,6 +5133,8 @@ setup(void)
     net_atom[NetWMFrameExtents]      = XInternAtom(display, "_NET_FRAME_EXTENTS", False);
     net_atom[NetDesktopNames]        = XInternAtom(display, "_NET_DESKTOP_NAMES", False);
     net_atom[NetDesktopViewport]     = XInternAtom(display, "_NET_DESKTOP_VIEWPORT", False);
+    net_atom[NetWMSyncRequest]       = XInternAtom(display, "_NET_WM_SYNC_REQUEST", False);
+    net_atom[NetWMSyncRequestCounter] = XInternAtom(display, "_NET_WM_SYNC_REQUEST_COUNTER", False);
 
     /* Some icccm atoms */
     wm_atom[WMDeleteWindow]          = XInternAtom(display, "WM_DELETE_WINDOW", False);
@@ -2034,6 +5145,7 @@ setup(void)
     net_berry[BerryWindowStatus]     = XInternAtom(display, "BERRY_WINDOW_STATUS", False);
     net_berry[BerryClientEvent]      = XInternAtom(display, "BERRY_CLIENT_EVENT", False);
     net_berry[BerryFontProperty]     = XInternAtom(display, "BERRY_FONT_PROPERTY", False);
+    net_berry[BerryClientBatch]      = XInternAtom(display, "BERRY_CLIENT_BATCH", False);
 
     LOGN("Successfully assigned atoms");
 
@@ -2045,8 +5157,7 @@ setup(void)
     LOGN("Successfully set initial properties");
 
     /* Set the total number of desktops */
-    data[0] = WORKSPACE_NUMBER;
-    XChangeProperty(display, root, net_atom[NetNumberOfDesktops], XA_CARDINAL, 32, PropModeReplace, (unsigned char *) data, 1);
+    ewmh_set_number_of_desktops();
 
     /* Set the intial "current desktop" to 0 */
     data2[0] = curr_ws;
@@ -2060,25 +5171,38 @@ setup(void)
         m_list[mon].y + m_list[mon].height / 2);
 
     gc = XCreateGC(display, root, 0, 0);
+    outline_gc = XCreateGC(display, root, GCFunction | GCSubwindowMode | GCLineWidth | GCForeground,
+            &(XGCValues) { .function = GXinvert, .subwindow_mode = IncludeInferiors,
+                           .line_width = OUTLINE_WIDTH, .foreground = WhitePixel(display, screen) });
 
     LOGN("Allocating color values");
-    XftColorAllocName(display, DefaultVisual(display, screen), DefaultColormap(display, screen),
-            TEXT_FOCUS_COLOR, &xft_focus_color);
-    XftColorAllocName(display, DefaultVisual(display, screen), DefaultColormap(display, screen),
-            TEXT_UNFOCUS_COLOR, &xft_unfocus_color);
+    text_focus = color_acquire(TEXT_FOCUS_COLOR);
+    text_unfocus = color_acquire(TEXT_UNFOCUS_COLOR);
+    if (text_focus == NULL || text_unfocus == NULL) {
+        LOGN("Error, could not allocate the title colors");
+        exit(EXIT_FAILURE);
+    }
 
-    font = XftFontOpenName(display, screen, global_font);
-    ewmh_set_desktop_names();
+    font_res = font_acquire(global_font);
+    font = font_res != NULL ? font_res->font : NULL;
+    conf_applied = conf;
+    title_gen_applied = title_gen;
+    ewmh_set_desktop_names(false);
+#if LOG_LEVEL >= LOG_TRACE
+    signal(SIGUSR1, trace_signal);
+#endif
+    manage_existing_windows();
+    ipc_socket_setup();
+    if (conf.shm_status)
+        conf.shm_status = shm_status_open();
 }
 
 static void
 client_show(struct client *c)
 {
     if (c->hidden) {
-        LOGN("Showing client");
-        client_move_absolute(c, c->x_hide, c->geom.y);
+        client_set_hidden(c, false);
         client_raise(c);
-        c->hidden = false;
     }
 }
 
@@ -2103,43 +5227,118 @@ client_snap_right(struct client *c)
 static void
 switch_ws(int ws)
 {
-    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
-        if (i != ws && ws_m_list[i] == ws_m_list[ws]) {
-        /*if (i != ws) {*/
-            for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
-                client_hide(tmp);
-                LOGN("Hiding client...");
-            }
-        } else if (i == ws) {
-            int count, j;
-            count = 0;
-
-            // how many active clients are on the current workspace
-            for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
-                count++;
-                client_show(tmp);
-            }
-
-            if (count != 0) {
-                Window wins[count*2];
-                j = 0;
-
-                for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
-                    wins[j] = tmp->window;
-                    wins[j+1] = tmp->dec;
-                    j += 2;
-                }
+    if (ws < 0 || ws >= ws_count) {
+        LOGP("No workspace %d to switch to", ws);
+        return;
+    }
 
-                XRestackWindows(display, wins, count * 2);
-            }
-        }
+    for (int i = 0; i < ws_used_count; i++) {
+        int other = ws_used[i];
+        if (other != ws && ws_m_list[other] == ws_m_list[ws])
+            for (struct client *tmp = c_list[other]; tmp != NULL; tmp = tmp->next)
+                client_set_hidden(tmp, true);
+    }
+    /* Bring everything back first and stack it all at once */
+    for (struct client *tmp = c_list[ws]; tmp != NULL; tmp = tmp->next)
+        client_set_hidden(tmp, false);
+    ws_restack(ws);
+    if (ws != curr_ws && ipc_event_wanted(IPCEventWorkspace)) {
+        sb_printf(&event_line, "\"ws\":%d,\"previous\":%d,\"monitor\":%d", ws, curr_ws, ws_m_list[ws]);
+        ipc_event_send(IPCEventWorkspace);
     }
     curr_ws = ws;
     int mon = ws_m_list[ws];
     LOGP("Setting Screen #%d with active workspace %d", m_list[mon].screen, ws);
     client_manage_focus(c_list[curr_ws]);
     ewmh_set_active_desktop(ws);
-    XSync(display, True);
+    ignore_enter_events();
+    XFlush(display);
+}
+
+/* Grow each per workspace array to n entries, the new ones zeroed */
+static void *
+ws_array_grow(void *arr, size_t elem, int n)
+{
+    char *tmp = realloc(arr, n * elem);
+    if (tmp != NULL)
+        memset(tmp + ws_size * elem, 0, (n - ws_size) * elem);
+    return tmp;
+}
+
+static bool
+ws_grow(int n)
+{
+    void *tmp;
+
+    if (n <= ws_size)
+        return true;
+
+#define WS_GROW(arr) \
+    do { \
+        if ((tmp = ws_array_grow(arr, sizeof *(arr), n)) == NULL) \
+            return false; \
+        arr = tmp; \
+    } while (0)
+
+    WS_GROW(c_list);
+    WS_GROW(c_tail);
+    WS_GROW(f_list);
+    WS_GROW(f_tail);
+    WS_GROW(ws_index);
+    WS_GROW(p_grid);
+    WS_GROW(p_rects);
+    WS_GROW(ws_m_list);
+    WS_GROW(ws_used);
+    WS_GROW(ws_used_pos);
+#undef WS_GROW
+
+    ws_size = n;
+    return true;
+}
+
+/* Change the number of workspaces. Storage is kept when shrinking, so
+ * only growing past anything used before allocates. */
+static bool
+ws_set_count(int n)
+{
+    if (n < 1 || n > WORKSPACE_MAX || !ws_grow(n)) {
+        LOGP("Cannot have %d workspaces", n);
+        return false;
+    }
+    if (n == ws_count)
+        return true;
+
+    LOGP("Changing workspace count from %d to %d", ws_count, n);
+    if (curr_ws >= n)
+        switch_ws(n - 1);
+    for (int i = n; i < ws_count; i++)
+        while (c_list[i] != NULL)
+            client_send_to_ws(c_list[i], n - 1);
+    /* client_send_to_ws hides them whenever there is a single monitor,
+     * even if the workspace they landed on is the one shown */
+    if (curr_ws == n - 1)
+        switch_ws(curr_ws);
+
+    ws_count = n;
+    ewmh_set_number_of_desktops();
+    ewmh_set_desktop_names(true);
+    return true;
+}
+
+static void
+ws_used_add(int ws)
+{
+    ws_used_pos[ws] = ws_used_count;
+    ws_used[ws_used_count++] = ws;
+}
+
+static void
+ws_used_remove(int ws)
+{
+    int pos = ws_used_pos[ws], last = ws_used[--ws_used_count];
+
+    ws_used[pos] = last;
+    ws_used_pos[last] = pos;
 }
 
 static void
@@ -2171,11 +5370,159 @@ client_toggle_decorations(struct client *c)
 static void
 client_set_status(struct client *c)
 {
-    if (c == NULL)
+    shm_dirty = true;
+    if (c == NULL || c->s_dirty)
+        return;
+
+    c->s_dirty = true;
+    c->s_next = s_list;
+    s_list = c;
+}
+
+/* Write BERRY_WINDOW_STATUS for every client marked by client_set_status */
+static void
+status_flush(void)
+{
+    struct client *c;
+
+    while (s_list != NULL) {
+        c = s_list;
+        s_list = c->s_next;
+        c->s_next = NULL;
+        c->s_dirty = false;
+        client_write_status(c);
+    }
+}
+
+static bool
+shm_status_open(void)
+{
+    int fd;
+
+    if (shm_status != NULL)
+        return true;
+    if (ipc_shm_name(shm_status_name, sizeof shm_status_name) < 0)
+        return false;
+
+    fd = shm_open(shm_status_name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        LOGP("Could not open shared memory %s", shm_status_name);
+        return false;
+    }
+
+    /* Start from zeroes even if an old segment was left behind */
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(struct berry_shm)) < 0) {
+        close(fd);
+        shm_unlink(shm_status_name);
+        return false;
+    }
+    shm_status = mmap(NULL, sizeof(struct berry_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm_status == MAP_FAILED) {
+        shm_status = NULL;
+        shm_unlink(shm_status_name);
+        return false;
+    }
+
+    LOGP("Publishing status in shared memory %s", shm_status_name);
+    shm_status->version = BERRY_SHM_VERSION;
+    shm_status->size = sizeof(struct berry_shm);
+    shm_dirty = true;
+    return true;
+}
+
+static void
+shm_status_close(void)
+{
+    if (shm_status == NULL)
         return;
+
+    munmap(shm_status, sizeof(struct berry_shm));
+    shm_unlink(shm_status_name);
+    shm_status = NULL;
+}
+
+/* Rewrite the shared memory status under its seqlock, once per batch */
+static void
+shm_status_flush(void)
+{
+    struct berry_shm *s = shm_status;
+    uint32_t seq;
+    int n = 0, total = 0;
+
+    if (s == NULL || !shm_dirty)
+        return;
+    shm_dirty = false;
+
+    seq = s->seq;
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    s->curr_ws = curr_ws;
+    s->ws_count = ws_count;
+    s->focused = f_client != NULL ? f_client->window : 0;
+
+    s->monitor_count = MIN(m_count, BERRY_SHM_MONITORS);
+    for (int i = 0; i < s->monitor_count; i++)
+        s->monitors[i] = (struct berry_shm_monitor) { m_list[i].screen,
+            m_list[i].x, m_list[i].y, m_list[i].width, m_list[i].height };
+
+    memset(s->occupied, 0, sizeof s->occupied);
+    for (int i = 0; i < ws_used_count; i++) {
+        int ws = ws_used[i];
+        if (ws < BERRY_SHM_WORKSPACES)
+            s->occupied[ws / 32] |= 1u << (ws % 32);
+
+        for (struct client *c = c_list[ws]; c != NULL; c = c->next, total++) {
+            if (n == BERRY_SHM_WINDOWS)
+                continue;
+            struct berry_shm_window *w = &s->windows[n++];
+            w->window = c->window;
+            w->ws = ws;
+            w->monitor = ws_m_list[ws];
+            w->x = c->geom.x;
+            w->y = c->geom.y;
+            w->width = c->geom.width;
+            w->height = c->geom.height;
+            w->state = c->fullscreen ? BerryShmFullscreen : c->mono ? BerryShmMono :
+                c->hidden ? BerryShmHidden : BerryShmNormal;
+            w->decorated = c->decorated;
+        }
+    }
+    s->window_count = n;
+    s->window_total = total;
+
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+#ifdef __linux__
+    syscall(SYS_futex, &s->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* Drop a client that is going away from the dirty status list */
+static void
+status_forget(struct client *c)
+{
+    struct client **p;
+
+    if (!c->s_dirty)
+        return;
+
+    for (p = &s_list; *p != NULL; p = &(*p)->s_next) {
+        if (*p == c) {
+            *p = c->s_next;
+            break;
+        }
+    }
+    c->s_next = NULL;
+    c->s_dirty = false;
+}
+
+static void
+client_write_status(struct client *c)
+{
+    char str[sizeof(c->status)];
     int size = 0;
     int mon = 0;
-    char *str = NULL;
     char *state, *decorated;
 
     LOGN("Updating client status...");
@@ -2195,9 +5542,9 @@ client_set_status(struct client *c)
         decorated = "false";
 
 
+    mon = ws_m_list[c->ws];
     if (conf.json_status) {
-        mon = ws_m_list[c->ws];
-        size = asprintf(&str,
+        size = snprintf(str, sizeof(str),
                 "{"
                     "\"window\":\"0x%08x\","
                     "\"geom\":{"
@@ -2220,7 +5567,7 @@ client_set_status(struct client *c)
                 mon, m_list[mon].x, m_list[mon].y, m_list[mon].width, m_list[mon].height,
                 state, decorated);
     } else {
-        size = asprintf(&str,
+        size = snprintf(str, sizeof(str),
                 "0x%08x, " // window id
                 "%d, " // x
                 "%d, " // y
@@ -2237,14 +5584,24 @@ client_set_status(struct client *c)
                 mon, m_list[mon].x, m_list[mon].y, m_list[mon].width, m_list[mon].height);
     }
 
-    if (size == -1) {
-        LOGN("asprintf returned -1, could not report window status");
+    if (size < 0 || size >= (int)sizeof(str)) {
+        LOGN("Could not report window status");
         return;
     }
 
+    /* Nothing changed since the last write */
+    if (size == c->s_len && memcmp(str, c->status, size) == 0)
+        return;
+
+    memcpy(c->status, str, size);
+    c->s_len = size;
+    if (ipc_event_wanted(IPCEventGeometry)) {
+        sb_printf(&event_line, "\"window\":\"0x%08lx\",\"ws\":%d,\"x\":%d,\"y\":%d,\"width\":%d,\"height\":%d,\"state\":\"%s\"",
+                c->window, c->ws, c->geom.x, c->geom.y, c->geom.width, c->geom.height, state);
+        ipc_event_send(IPCEventGeometry);
+    }
     XChangeProperty(display, c->window, net_berry[BerryWindowStatus], utf8string, 8, PropModeReplace,
-            (unsigned char *) str, strlen(str));
-    free(str);
+            (unsigned char *) str, size);
 }
 
 static void
@@ -2264,9 +5621,12 @@ ewmh_set_viewport(void)
 static void
 ewmh_set_focus(struct client *c)
 {
-        XDeleteProperty(display, root, net_atom[NetActiveWindow]);
         f_client = c;
-        /* Tell EWMH about our new window */
+        shm_dirty = true;
+        /* Tell EWMH about our new window, unless it already knows */
+        if (c->window == active_window)
+            return;
+        active_window = c->window;
         XChangeProperty(display, root, net_atom[NetActiveWindow], XA_WINDOW, 32, PropModeReplace, (unsigned char *) &(c->window), 1);
 }
 
@@ -2300,40 +5660,108 @@ static void ewmh_set_frame_extents(struct client *c)
             XA_CARDINAL, 32, PropModeReplace, (unsigned char *) data, 4);
 }
 
+static void
+client_list_add(Window w)
+{
+    if (cl_count == cl_size) {
+        int size = cl_size == 0 ? CLIENT_LIST_INITIAL : cl_size * 2;
+        Window *tmp = realloc(cl_windows, size * sizeof(Window));
+        if (tmp == NULL) {
+            LOGN("Error, could not grow client list");
+            return;
+        }
+        cl_windows = tmp;
+        cl_size = size;
+    }
+
+    cl_windows[cl_count++] = w;
+}
+
+static void
+client_list_remove(Window w)
+{
+    for (int i = 0; i < cl_count; i++) {
+        if (cl_windows[i] == w) {
+            memmove(&cl_windows[i], &cl_windows[i + 1], (cl_count - i - 1) * sizeof(Window));
+            cl_count--;
+            return;
+        }
+    }
+}
+
+/* Mark _NET_CLIENT_LIST as stale, it is written once at the end of the batch */
 static void ewmh_set_client_list(void)
 {
-    /* Remove all current clients */
-    XDeleteProperty(display, root, net_atom[NetClientList]);
-    for (int i = 0; i < WORKSPACE_NUMBER; i++)
-        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next)
-            XChangeProperty(display, root, net_atom[NetClientList], XA_WINDOW, 32, PropModeAppend,
-                    (unsigned char *) &(tmp->window), 1);
+    cl_dirty = true;
+    shm_dirty = true;
+}
+
+static void ewmh_flush_client_list(void)
+{
+    if (!cl_dirty)
+        return;
+
+    LOGP("Publishing client list with %d windows", cl_count);
+    XChangeProperty(display, root, net_atom[NetClientList], XA_WINDOW, 32, PropModeReplace,
+            (unsigned char *) cl_windows, cl_count);
+    cl_dirty = false;
 }
 
 /*
 * Create and populate the values for _NET_DESKTOP_NAMES,
 * used by applications such as polybar for named workspaces.
 * By default, set the name of each workspaces to simply be the
-* index of that workspace.
+* index of that workspace. With keep, the names already set are kept
+* for the workspaces that remain.
 */
-static void ewmh_set_desktop_names(void)
+static void ewmh_set_desktop_names(bool keep)
 {
-    char** list = calloc(WORKSPACE_NUMBER, sizeof(char*));
-    for (int i = 0; i < WORKSPACE_NUMBER; i++)
-        asprintf(&list[i], "%d", i);
     XTextProperty text_prop;
-    Xutf8TextListToTextProperty(display, list, WORKSPACE_NUMBER, XUTF8StringStyle, &text_prop);
-    XSetTextProperty(display, root, &text_prop, XInternAtom(display, "_NET_DESKTOP_NAMES", False));
+    char **old = NULL;
+    int n = 0;
+
+    if (keep && XGetTextProperty(display, root, &text_prop, net_atom[NetDesktopNames])) {
+        Xutf8TextPropertyToTextList(display, &text_prop, &old, &n);
+        XFree(text_prop.value);
+    }
+
+    char** list = calloc(ws_count, sizeof(char*));
+    if (list == NULL) {
+        if (old)
+            XFreeStringList(old);
+        return;
+    }
+    for (int i = 0; i < ws_count; i++) {
+        if (i < n)
+            asprintf(&list[i], "%s", old[i]);
+        else
+            asprintf(&list[i], "%d", i);
+    }
+    Xutf8TextListToTextProperty(display, list, ws_count, XUTF8StringStyle, &text_prop);
+    XSetTextProperty(display, root, &text_prop, net_atom[NetDesktopNames]);
     XFree(text_prop.value);
-    for (int i = 0; i < WORKSPACE_NUMBER; i++)
+    for (int i = 0; i < ws_count; i++)
         free(list[i]);
     free(list);
+    if (old)
+        XFreeStringList(old);
+}
+
+static void
+ewmh_set_number_of_desktops(void)
+{
+    unsigned long data[1];
+    data[0] = ws_count;
+    shm_dirty = true;
+    XChangeProperty(display, root, net_atom[NetNumberOfDesktops], XA_CARDINAL, 32,
+            PropModeReplace, (unsigned char *) data, 1);
 }
 
 static void
 ewmh_set_active_desktop(int ws)
 {
     unsigned long data[1];
+    shm_dirty = true;
     data[0] = ws;
     XChangeProperty(display, root, net_atom[NetCurrentDesktop], XA_CARDINAL, 32,
             PropModeReplace, (unsigned char *) data, 1);